@@ -0,0 +1,309 @@
+/******************************************************************************/
+/*                                                                            */
+/* PARAMETER SWEEP                                                            */
+/*                                                                            */
+/******************************************************************************/
+
+// Runs the simulation for every combination of loss probability, corruption
+// probability, message interval and seed given on the command line, spread
+// over a pool of threads, and prints one table with a row per parameter point
+// averaged over the seeds. Each run has its own simulator and entity state
+// (see sim.h), so the runs share nothing.
+//
+// Build with:
+//
+//     $ gcc -O2 -DTRACE_MAX=0 batch.c simulator.c entity.c bintrace.c metrics.c checksum.c rng.c channel.c verify.c profile.c -o batch -lm -lpthread
+//
+// and run it like:
+//
+//     $ ./batch -l 0,0.1,0.2 -c 0,0.1 -i 5,10 -s 1-16 BeeMovie.txt
+//
+// Options:
+//
+// -l <list>    : Loss probabilities. Default 0.
+// -c <list>    : Corruption probabilities. Default 0.
+// -i <list>    : Average times between messages from layer 5. Default 10.
+// -s <list>    : Seeds. Ranges like 1-16 are allowed. Default 1.
+// -j <threads> : Number of threads. Default one per online CPU.
+// -p, -w, -q   : Protocol, window controller and queue limit, as for the
+//                simulator.
+// -n, -r       : Channel model and reordering, as for the simulator. Every
+//                run of the sweep uses the same ones.
+// -v           : Also print a row for every run.
+//
+// Every run is verified (see verify.h), and counts as complete when B
+// delivered exactly the bytes of the input file.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "checksum.h"
+#include "entity.h"
+#include "sim.h"
+
+#define MAX_VALUES 1024
+
+// One list of values from the command line.
+struct values {
+  double v[MAX_VALUES];
+  int n;
+};
+
+// One run of the sweep.
+struct job {
+  struct simconfig cfg;
+  struct simresult result;
+  int failed;
+};
+
+struct job *jobs;
+int njobs;
+int nextjob = 0;             // Next job a worker should take.
+pthread_mutex_t joblock = PTHREAD_MUTEX_INITIALIZER;
+
+// Parse a comma separated list of numbers into `vals`. When `ranges` is set, an
+// item may also be a range of integers like 1-16.
+void parselist(const char *arg, struct values *vals, int ranges) {
+  const char *p = arg;
+  char *end;
+  double lo, hi;
+
+  vals->n = 0;
+  while (*p != '\0') {
+    lo = strtod(p, &end);
+    if (end == p) {
+      printf("Error: Bad list %s\n", arg);
+      exit(-1);
+    }
+    hi = lo;
+    p = end;
+    if (ranges && *p == '-') {
+      hi = strtod(p + 1, &end);
+      if (end == p + 1 || hi < lo) {
+        printf("Error: Bad range in %s\n", arg);
+        exit(-1);
+      }
+      p = end;
+    }
+    for (; lo <= hi; lo += 1.0) {
+      if (vals->n == MAX_VALUES) {
+        printf("Error: More than %d values in %s\n", MAX_VALUES, arg);
+        exit(-1);
+      }
+      vals->v[vals->n++] = lo;
+    }
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      printf("Error: Bad list %s\n", arg);
+      exit(-1);
+    }
+  }
+}
+
+// Thread body: run jobs until there are none left.
+void *worker(void *arg) {
+  int j;
+
+  (void) arg;
+  while (1) {
+    pthread_mutex_lock(&joblock);
+    j = nextjob++;
+    pthread_mutex_unlock(&joblock);
+    if (j >= njobs) {
+      return NULL;
+    }
+    jobs[j].failed = sim_run(&jobs[j].cfg, &jobs[j].result) != 0;
+  }
+}
+
+int main(int argc, char* argv[]) {
+  struct values loss, corrupt, interval, seeds;
+  struct simconfig cfg;
+  struct simresult *r;
+  pthread_t *threads;
+  long nthreads;
+  FILE *f;
+  int verbose = 0;
+  int i, a, b, c, s, j, runs, complete;
+  double endtime, goodput, retrans, latmean, latp99;
+
+  parselist("0", &loss, 0);
+  parselist("0", &corrupt, 0);
+  parselist("10", &interval, 0);
+  parselist("1", &seeds, 1);
+  nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+  sim_defaults(&cfg);
+  cfg.output = NULL;
+  cfg.verify = 1;
+
+  for (i = 1; i < argc - 1; i++) {
+    if (strcmp(argv[i], "-l") == 0) {
+      parselist(argv[++i], &loss, 0);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      parselist(argv[++i], &corrupt, 0);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      parselist(argv[++i], &interval, 0);
+    } else if (strcmp(argv[i], "-s") == 0) {
+      parselist(argv[++i], &seeds, 1);
+    } else if (strcmp(argv[i], "-j") == 0) {
+      nthreads = atol(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0) {
+      i++;
+      if (strcmp(argv[i], "gbn") == 0) {
+        cfg.protocol = PROTO_GBN;
+      } else if (strcmp(argv[i], "sr") == 0) {
+        cfg.protocol = PROTO_SR;
+      } else {
+        printf("Error: Unknown protocol %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-w") == 0) {
+      i++;
+      if (strcmp(argv[i], "fixed") == 0) {
+        cfg.windowcontrol = WIN_FIXED;
+      } else if (strcmp(argv[i], "aimd") == 0) {
+        cfg.windowcontrol = WIN_AIMD;
+      } else if (strcmp(argv[i], "delay") == 0) {
+        cfg.windowcontrol = WIN_DELAY;
+      } else {
+        printf("Error: Unknown window controller %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-q") == 0) {
+      cfg.sendqueuemax = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      i++;
+      if (channel_parse(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad channel model %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-r") == 0) {
+      i++;
+      if (channel_parse_reorder(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad reordering %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-v") == 0) {
+      verbose = 1;
+    } else {
+      break;
+    }
+  }
+  if (i != argc - 1) {
+    printf("usage: %s [-l <losses>] [-c <corruptions>] [-i <intervals>] [-s <seeds>] [-j <threads>] [-p <gbn|sr>] [-w <fixed|aimd|delay>] [-q <msgs>] [-n <channel model>] [-r <reorder prob>[,<delay>]] [-v] <input file>\n", argv[0]);
+    exit(-1);
+  }
+  cfg.input = argv[i];
+  if (nthreads < 1) {
+    nthreads = 1;
+  }
+
+  f = fopen(cfg.input, "rb");
+  if (f == NULL) {
+    printf("Could not open input file.\n");
+    exit(-1);
+  }
+  fclose(f);
+
+  // One job per point of the grid, seeds innermost so that the runs of a
+  // parameter point are next to each other.
+  njobs = loss.n * corrupt.n * interval.n * seeds.n;
+  jobs = (struct job*) calloc(njobs, sizeof(struct job));
+  if (jobs == NULL) {
+    printf("Error: out of memory\n");
+    exit(-1);
+  }
+  j = 0;
+  for (a = 0; a < loss.n; a++) {
+    for (b = 0; b < corrupt.n; b++) {
+      for (c = 0; c < interval.n; c++) {
+        for (s = 0; s < seeds.n; s++) {
+          jobs[j].cfg = cfg;
+          jobs[j].cfg.lossprob    = loss.v[a];
+          jobs[j].cfg.corruptprob = corrupt.v[b];
+          jobs[j].cfg.lambda      = interval.v[c];
+          jobs[j].cfg.seed        = (int) seeds.v[s];
+          j++;
+        }
+      }
+    }
+  }
+
+  checksum_init();
+  if (nthreads > njobs) {
+    nthreads = njobs;
+  }
+  threads = (pthread_t*) malloc(nthreads * sizeof(pthread_t));
+  for (i = 0; i < nthreads; i++) {
+    if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+      printf("Error: could not start thread %d\n", i);
+      exit(-1);
+    }
+  }
+  for (i = 0; i < nthreads; i++) {
+    pthread_join(threads[i], NULL);
+  }
+  free(threads);
+
+  if (verbose) {
+    printf("%-8s %-8s %-8s %-6s %12s %12s %10s %10s %10s %s\n", "loss", "corrupt",
+           "interval", "seed", "endtime", "goodput", "retrans", "lat_mean", "lat_p99", "complete");
+    for (j = 0; j < njobs; j++) {
+      r = &jobs[j].result;
+      if (jobs[j].failed) {
+        printf("%-8g %-8g %-8g %-6d failed\n", jobs[j].cfg.lossprob,
+               jobs[j].cfg.corruptprob, jobs[j].cfg.lambda, jobs[j].cfg.seed);
+        continue;
+      }
+      printf("%-8g %-8g %-8g %-6d %12.3f %12.6f %10lld %10.3f %10.3f %s\n",
+             jobs[j].cfg.lossprob, jobs[j].cfg.corruptprob, jobs[j].cfg.lambda,
+             jobs[j].cfg.seed, r->endtime,
+             r->endtime > 0.0 ? r->metrics.bytes_delivered / r->endtime : 0.0,
+             r->metrics.retransmissions, r->metrics.lat_mean, r->metrics.lat_p99,
+             r->divergence < 0 ? "yes" : "no");
+    }
+    printf("\n");
+  }
+
+  // Rows are means over the seeds of each parameter point.
+  printf("%-8s %-8s %-8s %6s %9s %12s %12s %10s %10s %10s\n", "loss", "corrupt",
+         "interval", "runs", "complete", "endtime", "goodput", "rexmit/pkt",
+         "lat_mean", "lat_p99");
+  for (j = 0; j < njobs; j += seeds.n) {
+    runs = complete = 0;
+    endtime = goodput = retrans = latmean = latp99 = 0.0;
+    for (s = j; s < j + seeds.n; s++) {
+      if (jobs[s].failed) {
+        continue;
+      }
+      r = &jobs[s].result;
+      runs++;
+      if (r->divergence < 0) {
+        complete++;
+      }
+      endtime += r->endtime;
+      goodput += r->endtime > 0.0 ? r->metrics.bytes_delivered / r->endtime : 0.0;
+      retrans += r->metrics.pkts_sent[0] > 0 ?
+                 (double) r->metrics.retransmissions / r->metrics.pkts_sent[0] : 0.0;
+      latmean += r->metrics.lat_mean;
+      latp99  += r->metrics.lat_p99;
+    }
+    if (runs > 0) {
+      endtime /= runs;
+      goodput /= runs;
+      retrans /= runs;
+      latmean /= runs;
+      latp99  /= runs;
+    }
+    printf("%-8g %-8g %-8g %6d %9d %12.3f %12.6f %10.4f %10.3f %10.3f\n",
+           jobs[j].cfg.lossprob, jobs[j].cfg.corruptprob, jobs[j].cfg.lambda,
+           runs, complete, endtime, goodput, retrans, latmean, latp99);
+  }
+
+  free(jobs);
+  return 0;
+}
@@ -0,0 +1,536 @@
+/******************************************************************************/
+/*                                                                            */
+/* BENCHMARKS                                                                 */
+/*                                                                            */
+/******************************************************************************/
+
+// Measures how fast the simulator and the entities run, at two levels:
+//
+// - Microbenchmarks time single operations in a loop: inserting into the event
+//   list, starting and stopping a timer, sending a packet into layer 3, the
+//   packet checksum and the window test. They report nanoseconds per operation.
+// - End-to-end runs send synthetic inputs through a full simulation for every
+//   combination of size, loss and corruption given. They report events handled
+//   per second, wall time per byte delivered and the peak resident set size.
+//   Each run is done in a child process so its peak RSS is its own.
+//
+// This file includes simulator.c, so that the microbenchmarks can reach the
+// event list directly. Build with:
+//
+//     $ gcc -O2 -DTRACE_MAX=0 bench.c entity.c bintrace.c metrics.c checksum.c rng.c channel.c verify.c profile.c -o bench -lm
+//
+// and run it like:
+//
+//     $ ./bench -s 1M,16M,256M,1G -l 0,0.1 -c 0,0.1 -o results.jsonl
+//
+// Options:
+//
+// -m           : Only run the microbenchmarks.
+// -e           : Only run the end-to-end runs.
+// -s <list>    : Input sizes of the end-to-end runs. A K, M or G suffix
+//                multiplies by 2^10, 2^20 or 2^30. Default 1M,16M.
+// -l <list>    : Loss probabilities. Default 0,0.1.
+// -c <list>    : Corruption probabilities. Default 0,0.1.
+// -i <float>   : Average time between messages from layer 5. Default 10.
+// -p, -w, -q, -n, -r : Protocol, window controller, queue limit, channel model
+//                and reordering, as for the simulator.
+// -o <file>    : Also write every result as one JSON object per line to this
+//                file, for tracking results over time. The file is appended to.
+//
+// Results go to standard output as a table either way.
+
+// simulator.c is built into this program, and wants 64-bit file offsets
+// before any system header is included.
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "simulator.c"
+#include "checksum.h"
+
+#define MAX_VALUES 64
+
+// Minimum time each microbenchmark runs for, in seconds.
+#define MICRO_MIN_TIME 0.2
+
+// Synthetic input is cut from a block of random letters this long.
+#define PATTERN_SIZE 4096
+
+// Routines of entity.c measured below. They are not part of entity.h.
+int calcChecksum(const struct pkt *packet);
+int isWithinWindow(int base, int i, int size);
+
+// One list of values from the command line.
+struct values {
+  double v[MAX_VALUES];
+  int n;
+};
+
+// The synthetic input of an end-to-end run and what B received of it.
+struct synthetic {
+  long long size;          // Bytes to send.
+  long long sent;          // Bytes handed to layer 5 on A so far.
+  long long received;      // Bytes B delivered.
+  char pattern[PATTERN_SIZE];
+};
+
+// What a child process reports about its end-to-end run.
+struct e2eresult {
+  int failed;
+  double wall;             // Wall time of the run, in seconds.
+  long long received;      // Bytes B delivered.
+  struct simresult sim;
+};
+
+FILE *jsonfile = NULL;     // JSON results, or NULL.
+volatile int sink;         // Keeps results of the microbenchmarks alive.
+
+double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Parse a comma separated list of numbers into `vals`, allowing K, M and G
+// suffixes when `sizes` is set.
+void parselist(const char *arg, struct values *vals, int sizes) {
+  const char *p = arg;
+  char *end;
+  double v;
+
+  vals->n = 0;
+  while (*p != '\0') {
+    v = strtod(p, &end);
+    if (end == p || vals->n == MAX_VALUES) {
+      printf("Error: Bad list %s\n", arg);
+      exit(-1);
+    }
+    p = end;
+    if (sizes && (*p == 'K' || *p == 'M' || *p == 'G')) {
+      v *= *p == 'K' ? 1024.0 : *p == 'M' ? 1048576.0 : 1073741824.0;
+      p++;
+    }
+    vals->v[vals->n++] = v;
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      printf("Error: Bad list %s\n", arg);
+      exit(-1);
+    }
+  }
+}
+
+
+/****** MICROBENCHMARKS *******************************************************/
+
+// Each benchmark does `n` operations on the simulation selected in the calling
+// thread, leaves its event list as it found it, and returns how long the
+// operations took in seconds, leaving out any setup.
+
+// Insert an event into an event list holding `heapsize` others, then remove
+// the earliest one, as the main loop does.
+double bench_insertevent(long n, int heapsize) {
+  struct event *p;
+  struct rng r;
+  double start, elapsed;
+  long i;
+
+  rng_seed(&r, 1, 0);
+  for (i = 0; i < heapsize; i++) {
+    p = allocevent();
+    p->evtime = (float) rng_uniform(&r) * 1000;
+    insertevent(p);
+  }
+  start = now();
+  for (i = 0; i < n; i++) {
+    p = allocevent();
+    p->evtime = sim->evlist[0]->evtime + (float) rng_uniform(&r) * 1000;
+    insertevent(p);
+    freeevent(removeevent(0));
+  }
+  elapsed = now() - start;
+  while (sim->evcount > 0) {
+    freeevent(removeevent(0));
+  }
+  return elapsed;
+}
+
+// Start and stop A's timer. Stopped timers stay in the event list until they
+// reach its front, so the list is drained every so often, as the main loop
+// would, and that time is counted too.
+double bench_timer(long n) {
+  double start;
+  long i;
+
+  start = now();
+  for (i = 0; i < n; i++) {
+    starttimer(A, 20.0 + (i & 63));
+    stoptimer(A);
+    if ((i & 1023) == 1023) {
+      while (sim->evcount > 0) {
+        freeevent(removeevent(0));
+      }
+    }
+  }
+  while (sim->evcount > 0) {
+    freeevent(removeevent(0));
+  }
+  return now() - start;
+}
+
+// Send a packet from A into layer 3, with the loss and corruption of the
+// selected run, and take its arrival back out of the event list.
+double bench_tolayer3(long n) {
+  struct pkt packet;
+  double start;
+  long i;
+
+  memset(&packet, 0, sizeof(packet));
+  memcpy(packet.payload, "01234567890123456789", 20);
+  packet.length = 20;
+  start = now();
+  for (i = 0; i < n; i++) {
+    packet.seqnum = i & 1023;
+    tolayer3(A, packet);
+    if (sim->evcount > 0) {
+      freeevent(removeevent(0));
+    }
+    // Keep the channel from running ahead of the clock.
+    sim->channels[A].lastarrival = 0.0;
+  }
+  return now() - start;
+}
+
+double bench_checksum(long n) {
+  struct pkt packets[64];
+  struct rng r;
+  double start, elapsed;
+  long i;
+  int j, sum = 0;
+
+  rng_seed(&r, 1, 0);
+  memset(packets, 0, sizeof(packets));
+  for (i = 0; i < 64; i++) {
+    packets[i].seqnum = i;
+    packets[i].acknum = i + 1;
+    packets[i].length = 20;
+    for (j = 0; j < 20; j++) {
+      packets[i].payload[j] = 'a' + rng_next(&r) % 26;
+    }
+  }
+  start = now();
+  for (i = 0; i < n; i++) {
+    sum += calcChecksum(&packets[i & 63]);
+  }
+  elapsed = now() - start;
+  sink = sum;
+  return elapsed;
+}
+
+double bench_window(long n) {
+  double start, elapsed;
+  long i;
+  int sum = 0;
+
+  start = now();
+  for (i = 0; i < n; i++) {
+    sum += isWithinWindow((int) (i & 1023), (int) ((i * 7) & 1023), 8);
+  }
+  elapsed = now() - start;
+  sink = sum;
+  return elapsed;
+}
+
+// Run the microbenchmark `name` with doubling operation counts until it takes
+// at least MICRO_MIN_TIME, then report the time per operation.
+void micro(const char *name, double (*bench)(long, int), int arg) {
+  double elapsed;
+  long n = 1024;
+
+  for (;;) {
+    elapsed = bench(n, arg);
+    if (elapsed >= MICRO_MIN_TIME) {
+      break;
+    }
+    n *= 2;
+  }
+  printf("%-24s %12ld %12.2f %14.0f\n", name, n, elapsed * 1e9 / n, n / elapsed);
+  if (jsonfile != NULL) {
+    fprintf(jsonfile, "{\"time\":%ld,\"kind\":\"micro\",\"bench\":\"%s\",\"ops\":%ld,"
+            "\"ns_per_op\":%.3f,\"ops_per_sec\":%.0f}\n",
+            (long) time(NULL), name, n, elapsed * 1e9 / n, n / elapsed);
+  }
+}
+
+// Adapters giving every benchmark the signature micro() expects.
+double run_insertevent(long n, int heapsize) { return bench_insertevent(n, heapsize); }
+double run_timer(long n, int unused)    { (void) unused; return bench_timer(n); }
+double run_tolayer3(long n, int unused) { (void) unused; return bench_tolayer3(n); }
+double run_checksum(long n, int unused) { (void) unused; return bench_checksum(n); }
+double run_window(long n, int unused)   { (void) unused; return bench_window(n); }
+
+size_t noinput(void *arg, char *data, size_t max) {
+  (void) arg;
+  (void) data;
+  (void) max;
+  return 0;
+}
+
+void microbenchmarks(const struct simconfig *base) {
+  struct simconfig cfg = *base;
+  struct sim *s;
+
+  // A run with no input, whose event list is emptied so each benchmark starts
+  // from nothing. tolayer3 meets 10% loss and corruption.
+  cfg.readinput   = noinput;
+  cfg.output      = NULL;
+  cfg.lossprob    = 0.1;
+  cfg.corruptprob = 0.1;
+  cfg.trace       = 0;
+  s = sim_create(&cfg);
+  if (s == NULL) {
+    exit(-1);
+  }
+  while (sim->evcount > 0) {
+    freeevent(removeevent(0));
+  }
+
+  printf("%-24s %12s %12s %14s\n", "microbenchmark", "ops", "ns/op", "ops/s");
+  micro("insertevent/16", run_insertevent, 16);
+  micro("insertevent/1024", run_insertevent, 1024);
+  micro("insertevent/65536", run_insertevent, 65536);
+  micro("starttimer+stoptimer", run_timer, 0);
+  micro("tolayer3", run_tolayer3, 0);
+  micro("calcChecksum", run_checksum, 0);
+  micro("isWithinWindow", run_window, 0);
+  printf("\n");
+
+  sim_destroy(s);
+}
+
+
+/****** END-TO-END RUNS *******************************************************/
+
+size_t syntheticinput(void *arg, char *data, size_t max) {
+  struct synthetic *in = (struct synthetic*) arg;
+  size_t n = max, off;
+
+  if ((long long) n > in->size - in->sent) {
+    n = (size_t) (in->size - in->sent);
+  }
+  // max is a single message, far below PATTERN_SIZE, so one copy will do
+  // unless the pattern wraps.
+  off = (size_t) (in->sent % PATTERN_SIZE);
+  if (off + n <= PATTERN_SIZE) {
+    memcpy(data, in->pattern + off, n);
+  } else {
+    memcpy(data, in->pattern + off, PATTERN_SIZE - off);
+    memcpy(data + PATTERN_SIZE - off, in->pattern, n - (PATTERN_SIZE - off));
+  }
+  in->sent += n;
+  return n;
+}
+
+void syntheticoutput(void *arg, const char *data, int length) {
+  (void) data;
+  ((struct synthetic*) arg)->received += length;
+}
+
+// Run `cfg` with `size` bytes of synthetic input in a child process, which
+// reports back through a pipe. Sets `*maxrss` to the child's peak RSS in KB.
+void e2erun(const struct simconfig *base, long long size, struct e2eresult *res,
+            long *maxrss) {
+  struct simconfig cfg = *base;
+  struct synthetic *in;
+  struct rusage usage;
+  struct rng r;
+  double start;
+  pid_t pid;
+  int fds[2], status, i;
+  ssize_t got;
+
+  memset(res, 0, sizeof(*res));
+  res->failed = 1;
+  *maxrss = 0;
+  fflush(stdout);
+  if (jsonfile != NULL) {
+    fflush(jsonfile);
+  }
+  if (pipe(fds) != 0 || (pid = fork()) < 0) {
+    printf("Error: could not start a run\n");
+    exit(-1);
+  }
+
+  if (pid == 0) {
+    close(fds[0]);
+    in = (struct synthetic*) calloc(1, sizeof(struct synthetic));
+    rng_seed(&r, (uint64_t) cfg.seed, 0);
+    for (i = 0; i < PATTERN_SIZE; i++) {
+      in->pattern[i] = 'a' + rng_next(&r) % 26;
+    }
+    in->size = size;
+    cfg.readinput   = syntheticinput;
+    cfg.writeoutput = syntheticoutput;
+    cfg.cbarg       = in;
+    cfg.output      = NULL;
+    cfg.report      = NULL;
+    cfg.trace       = 0;
+
+    start = now();
+    res->failed = sim_run(&cfg, &res->sim) != 0;
+    res->wall = now() - start;
+    res->received = in->received;
+    if (write(fds[1], res, sizeof(*res)) != (ssize_t) sizeof(*res)) {
+      _exit(1);
+    }
+    _exit(0);
+  }
+
+  close(fds[1]);
+  got = read(fds[0], res, sizeof(*res));
+  close(fds[0]);
+  if (wait4(pid, &status, 0, &usage) == pid) {
+    *maxrss = usage.ru_maxrss;
+  }
+  if (got != (ssize_t) sizeof(*res) || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+    res->failed = 1;
+  }
+}
+
+void endtoend(const struct simconfig *base, const struct values *sizes,
+              const struct values *loss, const struct values *corrupt) {
+  struct simconfig cfg = *base;
+  struct e2eresult res;
+  long long size;
+  long maxrss;
+  int a, b, c;
+
+  printf("%-12s %-8s %-8s %12s %14s %14s %12s %10s %s\n", "size", "loss", "corrupt",
+         "wall_s", "events", "events/s", "ns/byte", "rss_kb", "complete");
+  for (a = 0; a < sizes->n; a++) {
+    for (b = 0; b < loss->n; b++) {
+      for (c = 0; c < corrupt->n; c++) {
+        size = (long long) sizes->v[a];
+        cfg.lossprob    = loss->v[b];
+        cfg.corruptprob = corrupt->v[c];
+        e2erun(&cfg, size, &res, &maxrss);
+        if (res.failed) {
+          printf("%-12lld %-8g %-8g failed\n", size, cfg.lossprob, cfg.corruptprob);
+          continue;
+        }
+        printf("%-12lld %-8g %-8g %12.3f %14lld %14.0f %12.2f %10ld %s\n", size,
+               cfg.lossprob, cfg.corruptprob, res.wall, res.sim.nevents,
+               res.sim.nevents / res.wall,
+               res.received > 0 ? res.wall * 1e9 / res.received : 0.0, maxrss,
+               res.received == size ? "yes" : "no");
+        if (jsonfile != NULL) {
+          fprintf(jsonfile, "{\"time\":%ld,\"kind\":\"e2e\",\"size\":%lld,\"loss\":%g,"
+                  "\"corrupt\":%g,\"interval\":%g,\"protocol\":%d,\"window\":%d,"
+                  "\"channel\":%d,\"wall_s\":%.6f,\"events\":%lld,\"events_per_sec\":%.0f,"
+                  "\"ns_per_byte\":%.3f,\"sim_time\":%.3f,\"maxrss_kb\":%ld,\"complete\":%s}\n",
+                  (long) time(NULL), size, cfg.lossprob, cfg.corruptprob, cfg.lambda,
+                  cfg.protocol, cfg.windowcontrol, cfg.channel.model, res.wall,
+                  res.sim.nevents, res.sim.nevents / res.wall,
+                  res.received > 0 ? res.wall * 1e9 / res.received : 0.0,
+                  res.sim.endtime, maxrss, res.received == size ? "true" : "false");
+        }
+      }
+    }
+  }
+}
+
+int main(int argc, char* argv[]) {
+  struct values sizes, loss, corrupt;
+  struct simconfig cfg;
+  int domicro = 1, doe2e = 1;
+  int i;
+
+  parselist("1M,16M", &sizes, 1);
+  parselist("0,0.1", &loss, 0);
+  parselist("0,0.1", &corrupt, 0);
+  sim_defaults(&cfg);
+  cfg.seed = 1;
+
+  for (i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "-m") == 0) {
+      doe2e = 0;
+    } else if (strcmp(argv[i], "-e") == 0) {
+      domicro = 0;
+    } else if (i + 1 == argc) {
+      break;
+    } else if (strcmp(argv[i], "-s") == 0) {
+      parselist(argv[++i], &sizes, 1);
+    } else if (strcmp(argv[i], "-l") == 0) {
+      parselist(argv[++i], &loss, 0);
+    } else if (strcmp(argv[i], "-c") == 0) {
+      parselist(argv[++i], &corrupt, 0);
+    } else if (strcmp(argv[i], "-i") == 0) {
+      cfg.lambda = atof(argv[++i]);
+    } else if (strcmp(argv[i], "-p") == 0) {
+      i++;
+      if (strcmp(argv[i], "gbn") == 0) {
+        cfg.protocol = PROTO_GBN;
+      } else if (strcmp(argv[i], "sr") == 0) {
+        cfg.protocol = PROTO_SR;
+      } else {
+        printf("Error: Unknown protocol %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-w") == 0) {
+      i++;
+      if (strcmp(argv[i], "fixed") == 0) {
+        cfg.windowcontrol = WIN_FIXED;
+      } else if (strcmp(argv[i], "aimd") == 0) {
+        cfg.windowcontrol = WIN_AIMD;
+      } else if (strcmp(argv[i], "delay") == 0) {
+        cfg.windowcontrol = WIN_DELAY;
+      } else {
+        printf("Error: Unknown window controller %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-q") == 0) {
+      cfg.sendqueuemax = atoi(argv[++i]);
+    } else if (strcmp(argv[i], "-n") == 0) {
+      i++;
+      if (channel_parse(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad channel model %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-r") == 0) {
+      i++;
+      if (channel_parse_reorder(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad reordering %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-o") == 0) {
+      i++;
+      jsonfile = fopen(argv[i], "a");
+      if (jsonfile == NULL) {
+        printf("Could not open results file.\n");
+        exit(-1);
+      }
+    } else {
+      break;
+    }
+  }
+  if (i != argc) {
+    printf("usage: %s [-m] [-e] [-s <sizes>] [-l <losses>] [-c <corruptions>] [-i <interval>] [-p <gbn|sr>] [-w <fixed|aimd|delay>] [-q <msgs>] [-n <channel model>] [-r <reorder prob>[,<delay>]] [-o <results file>]\n", argv[0]);
+    exit(-1);
+  }
+
+  checksum_init();
+  if (domicro) {
+    microbenchmarks(&cfg);
+  }
+  if (doe2e) {
+    endtoend(&cfg, &sizes, &loss, &corrupt);
+  }
+  if (jsonfile != NULL) {
+    fclose(jsonfile);
+  }
+  return 0;
+}
@@ -0,0 +1,97 @@
+/******************************************************************************/
+/*                                                                            */
+/* BINARY EVENT TRACE                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+// Writer side of the binary trace described in bintrace.h. Records go into a
+// fixed buffer that is written to the file with a single fwrite whenever it
+// fills up, so the cost per record is a struct copy.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+#define TRACE_BUFFER_RECORDS 65536
+
+struct bintrace {
+  FILE* file;
+  int count;              // Number of records waiting in buffer.
+  struct tracerec buffer[TRACE_BUFFER_RECORDS];
+};
+
+// Write all buffered records to the trace file.
+void bintrace_flush(struct bintrace *bt) {
+  if (bt->count > 0) {
+    fwrite(bt->buffer, sizeof(struct tracerec), bt->count, bt->file);
+    bt->count = 0;
+  }
+}
+
+struct bintrace *bintrace_open(const char *path) {
+  struct traceheader header;
+  struct bintrace *bt;
+
+  bt = (struct bintrace*) malloc(sizeof(struct bintrace));
+  if (bt == NULL) {
+    return NULL;
+  }
+  bt->file = fopen(path, "wb");
+  if (bt->file == NULL) {
+    free(bt);
+    return NULL;
+  }
+
+  memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.recsize = sizeof(struct tracerec);
+  fwrite(&header, sizeof(header), 1, bt->file);
+
+  bt->count = 0;
+  return bt;
+}
+
+void bintrace_log(struct bintrace *bt, float time, int kind, int entity,
+                  int flags, int evtype, float evtime, const struct pkt *packet) {
+  struct tracerec *rec;
+
+  if (bt->count == TRACE_BUFFER_RECORDS) {
+    bintrace_flush(bt);
+  }
+
+  rec = &bt->buffer[bt->count++];
+  rec->time   = time;
+  rec->evtime = evtime;
+  rec->kind   = kind;
+  rec->entity = entity;
+  rec->flags  = flags;
+  rec->evtype = evtype;
+  if (packet != NULL) {
+    rec->flags   |= TREC_HAS_PKT;
+    rec->seqnum   = packet->seqnum;
+    rec->acknum   = packet->acknum;
+    rec->checksum = packet->checksum;
+    rec->length   = packet->length;
+  } else {
+    rec->seqnum   = 0;
+    rec->acknum   = 0;
+    rec->checksum = 0;
+    rec->length   = 0;
+  }
+}
+
+void bintrace_log_deliver(struct bintrace *bt, float time, int entity, int length) {
+  bintrace_log(bt, time, TREC_TOLAYER5, entity, 0, 0, 0.0, NULL);
+  bt->buffer[bt->count - 1].length = length;
+}
+
+void bintrace_close(struct bintrace *bt) {
+  if (bt == NULL) {
+    return;
+  }
+  bintrace_flush(bt);
+  fclose(bt->file);
+  free(bt);
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* BINARY EVENT TRACE                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+// An optional, compact alternative to the printf trace. When enabled with the
+// `-t <file>` option, the simulator writes one fixed-size `tracerec` for every
+// event it handles and for every call to insertevent, tolayer3, tolayer5 and
+// the timer routines. Records are collected in memory and written out in large
+// batches. Use the `tracedump` program to turn a trace file into text or CSV.
+//
+// A trace file is a `traceheader` followed by any number of `tracerec`s, all in
+// the byte order of the machine that wrote it.
+
+#include "simulator.h"
+
+#define TRACE_MAGIC   "SIMTRACE"
+#define TRACE_VERSION 1
+
+// Record kinds.
+#define TREC_EVENT       0   // main loop is handling an event (evtype is set)
+#define TREC_INSERT      1   // an event was added to the event list
+#define TREC_TOLAYER3    2   // an entity passed a packet to layer 3
+#define TREC_START_TIMER 3   // an entity started its timer
+#define TREC_STOP_TIMER  4   // an entity stopped its timer
+#define TREC_TOLAYER5    5   // B passed a message to layer 5 (length is set)
+
+// Record flags.
+#define TREC_LOST        1   // packet was dropped by the medium
+#define TREC_CORRUPT     2   // packet was corrupted by the medium
+#define TREC_HAS_PKT     4   // seqnum, acknum and checksum are valid
+
+struct traceheader {
+  char magic[8];          // TRACE_MAGIC, not NUL terminated
+  int version;            // TRACE_VERSION
+  int recsize;            // sizeof(struct tracerec)
+};
+
+struct tracerec {
+  float time;             // simulator time when the record was made
+  float evtime;           // time of the event involved, if any
+  unsigned char kind;     // TREC_* kind
+  unsigned char entity;   // entity involved (0 for A, 1 for B)
+  unsigned char flags;    // TREC_* flags
+  unsigned char evtype;   // event type, for TREC_EVENT and TREC_INSERT
+  int seqnum;
+  int acknum;
+  int checksum;
+  int length;
+};
+
+// An open trace file and the records waiting to be written to it. Each
+// simulation has its own; the simulator keeps NULL when tracing is off, so a
+// run without `-t` pays nothing but the test.
+struct bintrace;
+
+// Open `path` and write the trace header. Returns NULL if the file could not be
+// created.
+struct bintrace *bintrace_open(const char *path);
+
+// Append one record. `packet` may be NULL.
+void bintrace_log(struct bintrace *bt, float time, int kind, int entity,
+                  int flags, int evtype, float evtime, const struct pkt *packet);
+
+// Append a TREC_TOLAYER5 record for a message of `length` bytes.
+void bintrace_log_deliver(struct bintrace *bt, float time, int entity, int length);
+
+// Write out any buffered records, close the trace file and free `bt`.
+void bintrace_close(struct bintrace *bt);
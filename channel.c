@@ -0,0 +1,199 @@
+/******************************************************************************/
+/*                                                                            */
+/* CHANNEL MODELS                                                             */
+/*                                                                            */
+/******************************************************************************/
+
+// The channel models described in channel.h. Every packet takes one number
+// from each stream its model uses, whether it is lost or not, so that with the
+// same seed the n-th packet always meets the same fate.
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+
+// Numbers rng_seed() gets for the streams of direction `d`. The loss and delay
+// streams keep the numbers they had when the simulator drew them itself, so a
+// seed gives the same Bernoulli run as before; the simulator's own streams use
+// d * 4 and d * 4 + 3.
+#define STREAM_LOSS(d)    ((d) * 4 + 1)
+#define STREAM_DELAY(d)   ((d) * 4 + 2)
+#define STREAM_BURST(d)   (8 + (d) * 2)
+#define STREAM_REORDER(d) (8 + (d) * 2 + 1)
+
+void channel_defaults(struct channelconfig *cfg) {
+  cfg->model        = CHANNEL_BERNOULLI;
+  cfg->lossprob     = 0.0;
+  cfg->gilbert_p    = 0.02;   // bursts start every 50 packets or so
+  cfg->gilbert_r    = 0.25;   // and last 4 packets on average
+  cfg->gilbert_h    = 1.0;
+  cfg->bandwidth    = 1.0;
+  cfg->propagation  = 5.0;
+  cfg->queue        = 16;
+  cfg->reorderprob  = 0.0;
+  cfg->reorderdelay = 10.0;
+}
+
+// Read up to `max` comma separated numbers from `p` into `vals`. Returns how
+// many were read, or -1 if `p` holds anything else.
+static int parsenumbers(const char *p, float *vals, int max) {
+  char *end;
+  int n = 0;
+
+  while (*p != '\0') {
+    if (n == max) {
+      return -1;
+    }
+    vals[n++] = strtof(p, &end);
+    if (end == p) {
+      return -1;
+    }
+    p = end;
+    if (*p == ',') {
+      p++;
+    } else if (*p != '\0') {
+      return -1;
+    }
+  }
+  return n;
+}
+
+int channel_parse(struct channelconfig *cfg, const char *spec) {
+  const char *params = strchr(spec, ':');
+  size_t len = params != NULL ? (size_t) (params - spec) : strlen(spec);
+  float vals[3];
+  int n = 0;
+
+  if (params != NULL) {
+    n = parsenumbers(params + 1, vals, 3);
+    if (n < 0) {
+      return -1;
+    }
+  }
+
+  if (len == 9 && strncmp(spec, "bernoulli", len) == 0 && n == 0) {
+    cfg->model = CHANNEL_BERNOULLI;
+  } else if (len == 7 && strncmp(spec, "gilbert", len) == 0) {
+    cfg->model = CHANNEL_GILBERT;
+    if (n > 0) cfg->gilbert_p = vals[0];
+    if (n > 1) cfg->gilbert_r = vals[1];
+    if (n > 2) cfg->gilbert_h = vals[2];
+  } else if (len == 4 && strncmp(spec, "link", len) == 0) {
+    cfg->model = CHANNEL_LINK;
+    if (n > 0) cfg->bandwidth   = vals[0];
+    if (n > 1) cfg->propagation = vals[1];
+    if (n > 2) cfg->queue       = (int) vals[2];
+    if (cfg->bandwidth <= 0.0 || cfg->propagation < 0.0 || cfg->queue < 1) {
+      return -1;
+    }
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int channel_parse_reorder(struct channelconfig *cfg, const char *spec) {
+  float vals[2];
+  int n = parsenumbers(spec, vals, 2);
+
+  if (n < 1 || vals[0] < 0.0 || (n > 1 && vals[1] < 0.0)) {
+    return -1;
+  }
+  cfg->reorderprob = vals[0];
+  if (n > 1) {
+    cfg->reorderdelay = vals[1];
+  }
+  return 0;
+}
+
+void channel_init(struct channel *ch, unsigned int seed, int direction) {
+  ch->lastarrival = 0.0;
+  ch->linkfree    = 0.0;
+  ch->bad         = 0;
+  rng_seed(&ch->loss,    seed, STREAM_LOSS(direction));
+  rng_seed(&ch->delay,   seed, STREAM_DELAY(direction));
+  rng_seed(&ch->burst,   seed, STREAM_BURST(direction));
+  rng_seed(&ch->reorder, seed, STREAM_REORDER(direction));
+}
+
+int channel_send(const struct channelconfig *cfg, struct channel *ch, float now,
+                 float *arrival) {
+  float lossdraw, delaydraw, burstdraw, holddraw, extradraw;
+  float lossprob, lastime, txtime;
+
+  lossdraw = (float) rng_uniform(&ch->loss);
+  lossprob = cfg->lossprob;
+  if (cfg->reorderprob > 0.0) {
+    holddraw  = (float) rng_uniform(&ch->reorder);
+    extradraw = (float) rng_uniform(&ch->reorder);
+  } else {
+    holddraw  = 1.0;
+    extradraw = 0.0;
+  }
+
+  switch (cfg->model) {
+  case CHANNEL_GILBERT:
+    // Change state first, so a packet can be the first one lost in a burst.
+    burstdraw = (float) rng_uniform(&ch->burst);
+    if (ch->bad) {
+      if (burstdraw < cfg->gilbert_r) {
+        ch->bad = 0;
+      }
+    } else if (burstdraw < cfg->gilbert_p) {
+      ch->bad = 1;
+    }
+    if (ch->bad) {
+      lossprob = cfg->gilbert_h;
+    }
+    // Delays are Bernoulli's.
+    // fall through
+
+  case CHANNEL_BERNOULLI:
+  default:
+    delaydraw = (float) rng_uniform(&ch->delay);
+    if (lossdraw < lossprob) {
+      return CHANNEL_LOST;
+    }
+
+    // The medium does not reorder by itself, so the packet arrives between 1
+    // and 10 time units after the latest arrival of packets currently in the
+    // medium on their way to the destination.
+    lastime = now;
+    if (ch->lastarrival > lastime) {
+      lastime = ch->lastarrival;
+    }
+    *arrival = lastime + 1 + (9*delaydraw);
+    break;
+
+  case CHANNEL_LINK:
+    // Packets waiting or being sent are those the link has not finished by
+    // `now`. Round the count up, as the one being sent still holds its slot.
+    txtime = 1.0f / cfg->bandwidth;
+    lastime = now;
+    if (ch->linkfree > lastime) {
+      if ((int) ceilf((ch->linkfree - now) / txtime - 1e-4f) >= cfg->queue) {
+        return CHANNEL_QUEUEFULL;
+      }
+      lastime = ch->linkfree;
+    }
+    ch->linkfree = lastime + txtime;
+
+    // Loss in transit happens after the packet has used its share of the link.
+    if (lossdraw < lossprob) {
+      return CHANNEL_LOST;
+    }
+    *arrival = ch->linkfree + cfg->propagation;
+    break;
+  }
+
+  // A held back packet does not delay those sent after it, so they may
+  // overtake it.
+  if (holddraw < cfg->reorderprob) {
+    *arrival += cfg->reorderdelay * extradraw;
+    return CHANNEL_DELIVERED;
+  }
+  ch->lastarrival = *arrival;
+  return CHANNEL_DELIVERED;
+}
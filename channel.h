@@ -0,0 +1,90 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* CHANNEL MODELS                                                             */
+/*                                                                            */
+/******************************************************************************/
+
+// Decides what happens to a packet on its way from one entity to the other:
+// whether it is lost, and when it arrives. Each direction is a separate
+// `channel` with its own state and random streams. Corruption is left to the
+// simulator and is the same under every model.
+//
+// Models:
+//
+// - CHANNEL_BERNOULLI : Every packet is lost with probability `lossprob`, and
+//                       arrives 1 to 10 time units after the later of now and
+//                       the last arrival on the channel. This is the original
+//                       simulator's channel and the default.
+// - CHANNEL_GILBERT   : Gilbert-Elliott burst loss. The channel moves between
+//                       a good state, where packets are lost with probability
+//                       `lossprob`, and a bad state, where they are lost with
+//                       probability `gilbert_h`. Delays are as for Bernoulli.
+// - CHANNEL_LINK      : A link sending `bandwidth` packets per time unit with a
+//                       fixed `propagation` delay, fed by a FIFO queue that
+//                       holds `queue` packets and drops new ones when full.
+//                       Packets that make it onto the link are then lost with
+//                       probability `lossprob`.
+//
+// Any model can also reorder: with probability `reorderprob` a packet is held
+// back by up to `reorderdelay` extra time units, and packets sent after it may
+// overtake it.
+
+#include "rng.h"
+
+#define CHANNEL_BERNOULLI 0
+#define CHANNEL_GILBERT   1
+#define CHANNEL_LINK      2
+
+// Fates of a packet, returned by channel_send().
+#define CHANNEL_DELIVERED 0   // the packet arrives
+#define CHANNEL_LOST      1   // the packet is lost in transit
+#define CHANNEL_QUEUEFULL 2   // the link queue was full, so the packet was dropped
+
+// Parameters of a channel model, shared by both directions.
+struct channelconfig {
+  int   model;          // CHANNEL_* model.
+  float lossprob;       // Loss probability, see above.
+  float gilbert_p;      // Gilbert: chance per packet of going from good to bad.
+  float gilbert_r;      // Gilbert: chance per packet of going from bad to good.
+  float gilbert_h;      // Gilbert: loss probability in the bad state.
+  float bandwidth;      // Link: packets sent per time unit.
+  float propagation;    // Link: time from the end of sending to arrival.
+  int   queue;          // Link: packets the queue holds, counting the one being sent.
+  float reorderprob;    // Chance a packet is held back; 0 for no reordering.
+  float reorderdelay;   // Most extra time a held back packet takes.
+};
+
+// State of one direction of the channel.
+struct channel {
+  float lastarrival;    // Arrival time later packets must not overtake.
+  float linkfree;       // Link: time the link has sent everything queued so far.
+  int   bad;            // Gilbert: set while in the bad state.
+  struct rng loss;      // Random streams of this direction.
+  struct rng delay;
+  struct rng burst;
+  struct rng reorder;
+};
+
+// Fill `cfg` with the Bernoulli model, no loss and no reordering. The other
+// models' parameters get defaults used when they are selected.
+void channel_defaults(struct channelconfig *cfg);
+
+// Select a model from a command line spec: "bernoulli", "gilbert[:p,r,h]" or
+// "link[:bandwidth,propagation,queue]". Parameters left out keep their values.
+// Returns 0, or -1 if the spec is not understood.
+int channel_parse(struct channelconfig *cfg, const char *spec);
+
+// Set reordering from a command line spec "prob[,maxdelay]". Returns 0, or -1
+// if the spec is not understood.
+int channel_parse_reorder(struct channelconfig *cfg, const char *spec);
+
+// Reset `ch` for a new run. Its random streams are taken from run seed `seed`,
+// using stream numbers that depend on `direction` (0 or 1).
+void channel_init(struct channel *ch, unsigned int seed, int direction);
+
+// Send a packet into `ch` at time `now`. Returns its fate, and when it is
+// CHANNEL_DELIVERED sets `*arrival` to the time it reaches the other side.
+int channel_send(const struct channelconfig *cfg, struct channel *ch, float now,
+                 float *arrival);
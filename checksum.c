@@ -0,0 +1,135 @@
+/******************************************************************************/
+/*                                                                            */
+/* PACKET CHECKSUM                                                            */
+/*                                                                            */
+/******************************************************************************/
+
+// Fields are read as 32 bit words straight from the packet. The words are
+// copied out with memcpy, which compilers turn into a single load, so the
+// payload needs no particular alignment.
+
+#include <stdint.h>
+#include <string.h>
+
+#include "checksum.h"
+
+#if defined(CHECKSUM_CRC32C) && defined(__SSE4_2__)
+#include <nmmintrin.h>
+#endif
+
+// Load the 4 bytes at `p` as a word in host byte order.
+static uint32_t loadword(const void *p) {
+  uint32_t v;
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+#ifndef CHECKSUM_CRC32C
+
+// One's complement sum of 16 bit words. Adding 32 bit words into a 64 bit
+// accumulator and folding the carries back in at the end gives the same sum
+// with a quarter of the additions.
+int checksum_pkt(const struct pkt *packet) {
+  uint64_t sum = 0;
+  int i;
+
+  sum += (uint32_t) packet->seqnum;
+  sum += (uint32_t) packet->acknum;
+  sum += (uint32_t) packet->length;
+  for (i = 0; i < 20; i += 4) {
+    sum += loadword(packet->payload + i);
+  }
+
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffffffff) + (sum >> 32);
+  sum = (sum & 0xffff) + (sum >> 16);
+  sum = (sum & 0xffff) + (sum >> 16);
+
+  return (int) (~sum & 0xffff);
+}
+
+void checksum_init() {
+}
+
+const char *checksum_name() {
+  return "internet";
+}
+
+#else
+
+// Add the 4 bytes of `word`, lowest first, to the running CRC.
+#ifdef __SSE4_2__
+
+static uint32_t crcword(uint32_t crc, uint32_t word) {
+  return _mm_crc32_u32(crc, word);
+}
+
+#else
+
+#define CRC32C_POLY 0x82f63b78   // Castagnoli polynomial, bit reversed
+
+// Slicing-by-4 tables: crctable[k][b] is the CRC of byte b followed by k zero
+// bytes, so a whole word is folded in with four independent lookups.
+uint32_t crctable[4][256];
+int crctable_ready = 0;
+
+static void crcinit() {
+  uint32_t c;
+  int i, k;
+
+  for (i = 0; i < 256; i++) {
+    c = i;
+    for (k = 0; k < 8; k++) {
+      c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+    }
+    crctable[0][i] = c;
+  }
+  for (i = 0; i < 256; i++) {
+    for (k = 1; k < 4; k++) {
+      crctable[k][i] = (crctable[k - 1][i] >> 8) ^ crctable[0][crctable[k - 1][i] & 0xff];
+    }
+  }
+  crctable_ready = 1;
+}
+
+static uint32_t crcword(uint32_t crc, uint32_t word) {
+  crc ^= word;
+  return crctable[3][crc & 0xff] ^ crctable[2][(crc >> 8) & 0xff] ^
+         crctable[1][(crc >> 16) & 0xff] ^ crctable[0][crc >> 24];
+}
+
+#endif
+
+int checksum_pkt(const struct pkt *packet) {
+  uint32_t crc = 0xffffffff;
+  int i;
+
+#ifndef __SSE4_2__
+  if (!crctable_ready) {
+    crcinit();
+  }
+#endif
+
+  crc = crcword(crc, (uint32_t) packet->seqnum);
+  crc = crcword(crc, (uint32_t) packet->acknum);
+  crc = crcword(crc, (uint32_t) packet->length);
+  for (i = 0; i < 20; i += 4) {
+    crc = crcword(crc, loadword(packet->payload + i));
+  }
+
+  return (int) ~crc;
+}
+
+void checksum_init() {
+#ifndef __SSE4_2__
+  if (!crctable_ready) {
+    crcinit();
+  }
+#endif
+}
+
+const char *checksum_name() {
+  return "crc32c";
+}
+
+#endif
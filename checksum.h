@@ -0,0 +1,30 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* PACKET CHECKSUM                                                            */
+/*                                                                            */
+/******************************************************************************/
+
+// The checksum the entities put in `pkt.checksum`. It covers every other
+// header field (seqnum, acknum and length) and all 20 bytes of the payload.
+//
+// Two algorithms are available, chosen at build time:
+//
+// - By default, the 16 bit Internet checksum (RFC 1071), summed a 32 bit word
+//   at a time.
+// - With -DCHECKSUM_CRC32C, CRC-32C (Castagnoli). This uses the SSE4.2 crc32
+//   instruction when the compiler targets it (e.g. with -msse4.2), and a
+//   lookup table otherwise. Both give the same value.
+
+#include "simulator.h"
+
+// Checksum of `packet`, ignoring its `checksum` field.
+int checksum_pkt(const struct pkt *packet);
+
+// Build any lookup tables checksum_pkt() needs. It does this itself on first
+// use, so this only has to be called before starting threads that checksum.
+void checksum_init();
+
+// Name of the algorithm checksum_pkt() was built with.
+const char *checksum_name();
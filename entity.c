@@ -10,7 +10,9 @@
 //
 // This file contains the actual code for the functions that will implement the
 // reliable transport protocols enabling entity "A" to reliably send information
-// to entity "B".
+// to entity "B", and in a duplex run "B" to send to "A" at the same time. Each
+// entity has a sending and a receiving half, and the same code runs both
+// directions.
 //
 // This is where you should write your code, and you should submit a modified
 // version of this file.
@@ -32,7 +34,7 @@
 //
 // To run this project you should be able to compile it with something like:
 //
-//     $ gcc entity.c simulator.c -o myproject
+//     $ gcc simcli.c simulator.c entity.c bintrace.c metrics.c checksum.c rng.c channel.c verify.c profile.c -o myproject -lm
 //
 // and then run it like:
 //
@@ -42,35 +44,151 @@
 // with a less ideal channel, and you should vary the random seed. However, for
 // testing it can be helpful to keep the seed constant.
 //
+// Adding -DTRACE_MAX=0 compiles out all trace output for fast runs (see
+// trace.h), and -DCHECKSUM_CRC32C switches packets to a CRC-32C checksum (see
+// checksum.h).
+//
 // The simulator will write the received data on entity "B" to a file called
-// `output.dat`.
+// `output.dat`, or to the file given with the `-o <file>` option. With
+// `-b <file>` the run is duplex: "B" sends that file to "A" as well, and what
+// "A" receives is written to the file given with `-a <file>`.
 
 #include <stdio.h>
 #include "simulator.h"
+#include "entity.h"
+#include "trace.h"
+#include "metrics.h"
+#include "checksum.h"
+#include <math.h>
 #include <stdlib.h>
 #include <string.h>
 
-int WINDOW_SIZE = 8;         // size of the window
+int WINDOW_SIZE = 8;         // size of the window with the fixed controller
+int WINDOW_MAX = 64;         // largest send window, and the SR receive window
 int LIMIT_SEQNUM = 1000;        // maximum sequence number for 16-bit GBN
-double RXMT_TIMEOUT = 20;     // retransmission timeout
-extern float time;         // simulation time
-
-// Entity A
-int firstPack;                     // first sequence number in the window
-int lastPack;                 // last sequence number in the window
-int nextMsg;                    // message index
-struct msg msgBuffer[1000];                 // message buffer
-struct pkt txPktBuffer[1000];               // packet buffer
-int msgCount;                   // message count
-
-// Entity B
-int expectSeqNum;               // expected sequence number
-int lastAckNum;                 // last acknowledgement number
-
-/**** A ENTITY ****/
+double RXMT_TIMEOUT = 20;     // initial retransmission timeout
+double RTO_MIN = 2;           // smallest timeout (one-way delay is at least 1)
+double RTO_MAX = 40;          // largest timeout after backoff
+double RTO_MAX_DUPLEX = 100;  // the same in a duplex run, see rtoMax()
+_Thread_local int SEND_QUEUE_MAX = SEND_QUEUE_DEFAULT; // most messages an entity queues before input is held, 0 for no limit
+_Thread_local int PROTOCOL = PROTO_GBN; // protocol in use, see entity.h
+_Thread_local int WINDOW_CONTROL = WIN_FIXED; // window controller in use, see entity.h
+_Thread_local int DUPLEX = 0; // B sends DATA to A as well, see entity.h
+_Thread_local double ACK_DELAY = 1; // duplex: longest an ACK waits for DATA to carry it, see entity.h
+int ACK_EVERY = 3;            // duplex: in-order packets that may share one delayed ACK
+
+// Sending half of an entity: the DATA it sends to the other entity
+struct sender
+{
+    int firstPack;                  // first sequence number in the window
+    int lastPack;                   // last sequence number in the window
+    struct msg *sendQueue;          // messages waiting for room in the window
+    int sendQueueHead;              // slot of the oldest queued message
+    int sendQueueLen;               // number of queued messages
+    int sendQueueCap;               // number of slots allocated in sendQueue
+    struct pkt txPktBuffer[1000];   // packet buffer
+    int pktAcked[1000];             // packet is known to have reached the other entity
+    float srDeadline[1000];         // SR: time at which packet is resent
+    float sendTime[1000];           // time packet was first sent
+    int retransmitted[1000];        // packet has been resent (Karn's rule)
+    double srtt;                    // smoothed round trip time
+    double rttvar;                  // round trip time variation
+    double rto;                     // current retransmission timeout
+    int rttSampled;                 // whether srtt holds a measurement yet
+    int sendWindow;                 // current send window, in packets
+    double cwnd;                    // window estimate kept by the controller
+    double ssthresh;                // AIMD: slow start threshold
+    double baseRtt;                 // delay: smallest round trip seen
+    int timerRunning;               // the retransmission timer is running
+    float timerDeadline;            // time the retransmission timer runs out
+    int clockRunning;               // the entity's simulator timer is running
+    float clockTime;                // time the simulator timer was set for
+};
+
+// Receiving half of an entity: the DATA it gets from the other entity
+struct receiver
+{
+    int expectSeqNum;               // expected sequence number
+    int lastAckNum;                 // last acknowledgement number
+    struct msg rcvBuffer[1000];     // messages received out of order
+    int rcvValid[1000];             // slot in rcvBuffer holds a message
+    int ackOwed;                    // duplex: packets in order whose ACK waits for DATA to carry it
+    float ackDeadline;              // duplex: time the ACK is sent on its own
+};
+
+// The state of both entities in one simulation (see entity_create). In a
+// one-way run only A's sending half and B's receiving half are used.
+struct entitystate
+{
+    struct sender send[2];          // sending halves of A and B
+    struct receiver receive[2];     // receiving halves of A and B
+};
+
+#define SIDE_A 0
+#define SIDE_B 1
+
+// State of the entities in the simulation the calling thread is running
+_Thread_local struct entitystate *E;
+
+// The entity whose routine is running, and its two halves. Each entry point
+// selects its own entity, so the routines below only ever see the state of
+// the entity they run for.
+_Thread_local int SIDE;
+_Thread_local struct sender *S;
+_Thread_local struct receiver *R;
+
+// Names of the running entity and the other one, for the trace
+#define ME   ("AB"[SIDE])
+#define PEER ("BA"[SIDE])
+
+// Work on entity `side`
+void selectSide(int side)
+{
+    SIDE = side;
+    S = &E->send[side];
+    R = &E->receive[side];
+}
+
+// Pass a packet to layer 3, to go to the other entity
+void sendPacket(struct pkt packet)
+{
+    if (SIDE == SIDE_A)
+        tolayer3_A(packet);
+    else
+        tolayer3_B(packet);
+}
+
+// Pass a message received in order up to layer 5
+void deliverMessage(struct msg message)
+{
+    if (SIDE == SIDE_A)
+        tolayer5_A(message);
+    else
+        tolayer5_B(message);
+}
+
+// Start the simulator timer of the entity
+void clockStart(float increment)
+{
+    if (SIDE == SIDE_A)
+        starttimer_A(increment);
+    else
+        starttimer_B(increment);
+}
+
+// Stop the simulator timer of the entity
+void clockStop(void)
+{
+    if (SIDE == SIDE_A)
+        stoptimer_A();
+    else
+        stoptimer_B();
+}
+
+/**** WINDOWS AND CHECKSUMS ****/
 void printWindow(int base)
 {
-    int i, end = (base + WINDOW_SIZE) % LIMIT_SEQNUM;
+    int i, end = (base + S->sendWindow) % LIMIT_SEQNUM;
 
     printf("    WINDOW: [");
     for (i = base; i != end; i = (i + 1) % LIMIT_SEQNUM)
@@ -78,285 +196,1300 @@ void printWindow(int base)
     printf(" ]\n");
 }
 
-// Check if number is within window
-int isWithinWindow(int base, int i)
+// Check if number is within the window of `size` starting at base
+int isWithinWindow(int base, int i, int size)
 {
     // Number located right of base
-    int right = i >= base && i < base + WINDOW_SIZE;
+    int right = i >= base && i < base + size;
 
     // Number located left of base
-    int left = i < base && i + LIMIT_SEQNUM < base + WINDOW_SIZE;
+    int left = i < base && i + LIMIT_SEQNUM < base + size;
 
     return right || left;
 }
 
-// Calculate checksum of packet
-int calcChecksum(struct pkt packet)
+// Check if sequence number has been sent but not yet slid out of the send window
+int isInFlight(int seqnum)
 {
-    int i, checksum = 0;
+    int offset = (seqnum - S->firstPack + LIMIT_SEQNUM) % LIMIT_SEQNUM;
+    int outstanding = (S->lastPack - S->firstPack + LIMIT_SEQNUM) % LIMIT_SEQNUM;
 
-    checksum += packet.seqnum;
-    checksum += packet.acknum;
+    return seqnum >= 0 && seqnum < LIMIT_SEQNUM && offset < outstanding;
+}
 
-    for (i = 0; i < 20; i++)
-        checksum += packet.payload[i];
+// Calculate checksum of packet (see checksum.h)
+int calcChecksum(const struct pkt *packet)
+{
+    return checksum_pkt(packet);
+}
 
-    return checksum;
+// Check the length field of a packet can be used to copy its payload
+int isValidLength(const struct pkt *packet)
+{
+    return packet->length >= 0 && packet->length <= 20;
 }
 
 // Check packet for errors
-int isCorrupt(struct pkt packet)
+int isCorrupt(const struct pkt *packet)
+{
+    return calcChecksum(packet) != packet->checksum;
+}
+
+/**** RETRANSMISSION TIMEOUT ****/
+
+// The retransmission timeout is estimated from round trip samples as in RFC
+// 6298 (Jacobson's algorithm). Packets that were resent give no sample, since
+// their ACK could belong to either copy (Karn's rule), and every timeout
+// doubles the timeout until a fresh sample arrives.
+
+// Record that a new packet was just sent
+void rttSent(int seqnum)
+{
+    S->sendTime[seqnum] = simtime();
+    S->retransmitted[seqnum] = 0;
+}
+
+// Largest timeout. In a duplex run ACKs queue in the channel behind the other
+// direction's DATA, so a round trip can take far longer than RTO_MAX; with the
+// timeout capped below it, every packet would be resent before its ACK could
+// arrive and the resent packets would only lengthen the queue.
+double rtoMax(void)
+{
+    return DUPLEX ? RTO_MAX_DUPLEX : RTO_MAX;
+}
+
+// Update the timeout estimate from the ACK of a packet. Returns the round
+// trip sample, or -1 if the packet gave none.
+double rttSample(int seqnum)
+{
+    double sample;
+
+    if (S->retransmitted[seqnum])
+        return -1;
+
+    sample = simtime() - S->sendTime[seqnum];
+    if (!S->rttSampled)
+    {
+        S->srtt = sample;
+        S->rttvar = sample / 2;
+        S->rttSampled = 1;
+    }
+    else
+    {
+        S->rttvar = 0.75 * S->rttvar + 0.25 * fabs(S->srtt - sample);
+        S->srtt = 0.875 * S->srtt + 0.125 * sample;
+    }
+
+    S->rto = S->srtt + 4 * S->rttvar;
+    if (S->rto < RTO_MIN)
+        S->rto = RTO_MIN;
+    if (S->rto > rtoMax())
+        S->rto = rtoMax();
+
+    return sample;
+}
+
+// Back off the timeout after it ran out
+void rttBackoff(void)
+{
+    S->rto *= 2;
+    if (S->rto > rtoMax())
+        S->rto = rtoMax();
+}
+
+/**** WINDOW CONTROL ****/
+
+// The send window is set by one of three controllers, chosen with the
+// simulator's -w option:
+// - fixed: always WINDOW_SIZE packets.
+// - aimd:  TCP Reno style. Slow start doubles the window every round trip up
+//          to ssthresh, congestion avoidance then adds one packet per round
+//          trip, and a timeout halves ssthresh and restarts from one packet.
+// - delay: TCP Vegas style. Compares the expected and actual throughput to
+//          estimate how many packets sit in the channel queue, and grows or
+//          shrinks the window by one packet per round trip to keep that
+//          between WINDOW_ALPHA and WINDOW_BETA.
+
+#define WINDOW_ALPHA 1.0
+#define WINDOW_BETA  3.0
+
+// Recompute sendWindow from cwnd
+void windowUpdate(void)
+{
+    S->sendWindow = (int) S->cwnd;
+    if (S->sendWindow < 1)
+        S->sendWindow = 1;
+    if (S->sendWindow > WINDOW_MAX)
+        S->sendWindow = WINDOW_MAX;
+}
+
+// Set up the window controller
+void windowInit(void)
+{
+    S->cwnd = (WINDOW_CONTROL == WIN_FIXED) ? WINDOW_SIZE : 1;
+    S->ssthresh = WINDOW_MAX;
+    S->baseRtt = -1;
+    windowUpdate();
+}
+
+// Adjust the window after `count` packets were newly ACKed. `sample` is the
+// round trip of the ACKed packet, or -1 if it gave none.
+void windowOnAck(int count, double sample)
+{
+    double queued;
+    int i;
+
+    switch (WINDOW_CONTROL)
+    {
+    case WIN_AIMD:
+        for (i = 0; i < count; i++)
+        {
+            if (S->cwnd < S->ssthresh)
+                S->cwnd += 1;
+            else
+                S->cwnd += 1 / S->cwnd;
+        }
+        break;
+
+    case WIN_DELAY:
+        if (sample <= 0)
+            break;
+        if (S->baseRtt < 0 || sample < S->baseRtt)
+            S->baseRtt = sample;
+
+        // Packets in the channel beyond what the base round trip explains
+        queued = S->cwnd * (1 - S->baseRtt / sample);
+        for (i = 0; i < count; i++)
+        {
+            if (queued < WINDOW_ALPHA)
+                S->cwnd += 1 / S->cwnd;
+            else if (queued > WINDOW_BETA && S->cwnd > 1)
+                S->cwnd -= 1 / S->cwnd;
+        }
+        break;
+
+    default:
+        break;
+    }
+
+    if (S->cwnd > WINDOW_MAX)
+        S->cwnd = WINDOW_MAX;
+    windowUpdate();
+}
+
+// Adjust the window after the retransmission timer ran out
+void windowOnTimeout(void)
+{
+    switch (WINDOW_CONTROL)
+    {
+    case WIN_AIMD:
+        S->ssthresh = S->cwnd / 2;
+        if (S->ssthresh < 2)
+            S->ssthresh = 2;
+        S->cwnd = 1;
+        break;
+
+    case WIN_DELAY:
+        S->cwnd = S->cwnd / 2;
+        if (S->cwnd < 1)
+            S->cwnd = 1;
+        break;
+
+    default:
+        break;
+    }
+    windowUpdate();
+}
+
+/**** SELECTIVE ACKNOWLEDGEMENT ****/
+
+// Every ACK sent on its own carries a SACK block in its payload, which the
+// checksum covers like any other payload:
+//
+//   bytes 0-3  : next sequence number the receiver expects (all earlier ones
+//                arrived)
+//   bytes 4-11 : bitmap, bit k set if packet (next + k) is buffered there
+//
+// The sender marks every packet the block reports in pktAcked and never
+// resends those.
+
+#define SACK_BITS   64        // packets covered by the bitmap, >= WINDOW_MAX
+#define SACK_LENGTH 12        // bytes of the payload used by the block
+
+// Fill the payload and length of an ACK with the receiver's SACK block
+void sackEncode(struct pkt *ack)
+{
+    int k;
+
+    memset(ack->payload, 0, sizeof(ack->payload));
+    memcpy(ack->payload, &R->expectSeqNum, sizeof(int));
+    for (k = 0; k < SACK_BITS; k++)
+    {
+        if (R->rcvValid[(R->expectSeqNum + k) % LIMIT_SEQNUM])
+            ack->payload[4 + k / 8] |= 1 << (k % 8);
+    }
+    ack->length = SACK_LENGTH;
+}
+
+// Mark the packets a SACK block reports as received. Returns how many
+// outstanding packets were not marked before.
+int sackDecode(const struct pkt *ack)
+{
+    int next, k, seqnum, count = 0;
+
+    if (ack->length != SACK_LENGTH)
+        return 0;
+
+    memcpy(&next, ack->payload, sizeof(int));
+    if (next < 0 || next >= LIMIT_SEQNUM)
+        return 0;
+
+    for (k = 0; k < SACK_BITS; k++)
+    {
+        seqnum = (next + k) % LIMIT_SEQNUM;
+        if ((ack->payload[4 + k / 8] & (1 << (k % 8))) && isInFlight(seqnum) && !S->pktAcked[seqnum])
+        {
+            S->pktAcked[seqnum] = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Print the SACK block of an ACK
+void sackPrint(const struct pkt *ack)
+{
+    int next, k;
+
+    memcpy(&next, ack->payload, sizeof(int));
+    printf("    SACK: next %d, buffered:", next);
+    for (k = 0; k < SACK_BITS; k++)
+    {
+        if (ack->payload[4 + k / 8] & (1 << (k % 8)))
+            printf(" %d", (next + k) % LIMIT_SEQNUM);
+    }
+    printf("\n");
+}
+
+/**** DUPLEX ACKNOWLEDGEMENT ****/
+
+// In a duplex run both entities send DATA, and every packet carries in its
+// acknum the cumulative ACK of its sender's receiving half: the last sequence
+// number it delivered in order. A packet with seqnum NO_SEQNUM is a pure ACK,
+// with a SACK block as above; any other is DATA.
+//
+// The ACK for DATA is held for up to ACK_DELAY, so that DATA going the other
+// way can carry it, and is sent on its own if none does or ACK_EVERY packets
+// arrive in order first, much like TCP's delayed ACK. DATA out of order or
+// already delivered only needs the ACK owed: a burst of resent packets would
+// otherwise be answered by as many pure ACKs, all queued behind the other
+// direction's DATA.
+
+#define NO_SEQNUM -1
+
+// Check whether a packet is a pure ACK. In a one-way run every packet A gets
+// is an ACK and every packet B gets is DATA.
+int isAck(const struct pkt *packet)
+{
+    if (!DUPLEX)
+        return SIDE == SIDE_A;
+    return packet->seqnum == NO_SEQNUM;
+}
+
+// Cumulative ACK of the receiving half
+int ackNumber(void)
+{
+    return (R->expectSeqNum + LIMIT_SEQNUM - 1) % LIMIT_SEQNUM;
+}
+
+void timerArm(void);
+
+// Send a pure ACK now
+void ackSend(void)
+{
+    struct pkt new_packet;
+    int owed = R->ackOwed;
+
+    new_packet.seqnum = NO_SEQNUM;
+    new_packet.acknum = ackNumber();
+    sackEncode(&new_packet);
+    new_packet.checksum = calcChecksum(&new_packet);
+    R->ackOwed = 0;
+
+    TRACEF(1, "  %c: Sending ACK to %c...\n", ME, PEER);
+    TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+    TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+    if (TRACE_ON(1))
+        sackPrint(&new_packet);
+    sendPacket(new_packet);
+
+    // The timer no longer needs to wait for this ACK
+    if (owed)
+        timerArm();
+}
+
+// Acknowledge DATA, which may have arrived in order
+void ackOwe(int inOrder)
+{
+    if (R->ackOwed)
+    {
+        if (inOrder && ++R->ackOwed >= ACK_EVERY)
+            ackSend();
+        return;
+    }
+    R->ackOwed = 1;
+    R->ackDeadline = simtime() + ACK_DELAY;
+    timerArm();
+}
+
+// Put the receiving half's ACK on DATA about to be sent, which settles any ACK
+// owed. Does nothing in a one-way run.
+void ackPiggyback(struct pkt *packet)
+{
+    if (!DUPLEX)
+        return;
+    packet->acknum = ackNumber();
+    packet->checksum = calcChecksum(packet);
+    if (R->ackOwed)
+    {
+        R->ackOwed = 0;
+        timerArm();
+    }
+}
+
+/**** TIMER ****/
+
+// Each entity has a single simulator timer. The sending half uses it as its
+// retransmission timer, and in a duplex run the receiving half needs it too,
+// to send an ACK that has waited ACK_DELAY. The simulator timer is kept set
+// for whichever of the two is due first.
+
+// Set the simulator timer for the earliest of the pending deadlines
+void timerArm(void)
 {
-    return calcChecksum(packet);
+    int set = 0;
+    float at = 0;
+
+    if (S->timerRunning)
+    {
+        at = S->timerDeadline;
+        set = 1;
+    }
+    if (R->ackOwed && (!set || R->ackDeadline < at))
+    {
+        at = R->ackDeadline;
+        set = 1;
+    }
+
+    if (S->clockRunning && set && S->clockTime == at)
+        return;
+    if (S->clockRunning)
+    {
+        clockStop();
+        S->clockRunning = 0;
+    }
+    if (set)
+    {
+        clockStart(at > simtime() ? at - simtime() : 0);
+        S->clockRunning = 1;
+        S->clockTime = at;
+    }
 }
 
+// Start the retransmission timer
+void timerStart(float increment)
+{
+    S->timerRunning = 1;
+    S->timerDeadline = simtime() + increment;
+
+    // With nothing else waiting on it, the simulator timer is set exactly as asked
+    if (!S->clockRunning && !R->ackOwed)
+    {
+        clockStart(increment);
+        S->clockRunning = 1;
+        S->clockTime = S->timerDeadline;
+        return;
+    }
+    timerArm();
+}
+
+// Stop the retransmission timer
+void timerStop(void)
+{
+    S->timerRunning = 0;
+    timerArm();
+}
+
+/**** SEND QUEUE ****/
+
+// Messages from layer 5 wait in a ring buffer until the window has room for
+// them, and are released as soon as they are packetized; from then on the copy
+// in txPktBuffer is the one kept until the other entity has it. The ring starts at
+// SEND_QUEUE_INIT slots and doubles whenever it fills.
+#define SEND_QUEUE_INIT 64
+
+// Append a message to the send queue
+void queuePush(const struct msg *message)
+{
+    if (S->sendQueueLen == S->sendQueueCap)
+    {
+        int newCap = S->sendQueueCap > 0 ? 2 * S->sendQueueCap : SEND_QUEUE_INIT;
+        struct msg *grown = malloc(newCap * sizeof(struct msg));
+        int i;
+
+        if (grown == NULL)
+        {
+            printf("%c: out of memory for the send queue\n", ME);
+            exit(-1);
+        }
+
+        // Unwrap the ring so the oldest message is at slot 0
+        for (i = 0; i < S->sendQueueLen; i++)
+            grown[i] = S->sendQueue[(S->sendQueueHead + i) % S->sendQueueCap];
+
+        free(S->sendQueue);
+        S->sendQueue = grown;
+        S->sendQueueHead = 0;
+        S->sendQueueCap = newCap;
+    }
+
+    S->sendQueue[(S->sendQueueHead + S->sendQueueLen) % S->sendQueueCap] = *message;
+    S->sendQueueLen++;
+}
+
+// Oldest message in the send queue, which must not be empty
+struct msg *queueFront(void)
+{
+    return &S->sendQueue[S->sendQueueHead];
+}
+
+// Drop the oldest message from the send queue
+void queuePop(void)
+{
+    S->sendQueueHead = (S->sendQueueHead + 1) % S->sendQueueCap;
+    S->sendQueueLen--;
+}
+
+// Check whether the entity can take another message from layer 5. Once
+// SEND_QUEUE_MAX messages are waiting, input is held back until the window
+// moves, so a large file streams through in bounded memory.
+int sendReady(void)
+{
+    return SEND_QUEUE_MAX <= 0 || S->sendQueueLen < SEND_QUEUE_MAX;
+}
+
+/**** SELECTIVE REPEAT ****/
+
+// In Selective Repeat mode every packet in the send window has its own logical
+// timer (srDeadline). The retransmission timer is always set to fire at the
+// earliest deadline, and only packets whose deadline has passed are resent.
+// The receiver ACKs each packet individually (cumulatively in a duplex run)
+// and buffers out-of-order packets until the gap is filled.
+
+// Slack when comparing a deadline against the current time. Simulator times
+// are floats, so a timer may fire a hair before the deadline it was set for.
+#define SR_DEADLINE_SLACK 0.001
+
+// Restart the retransmission timer so it fires at the earliest deadline in
+// the window
+void srArmTimer(void)
+{
+    int i, found = 0;
+    float earliest = 0;
+
+    if (S->timerRunning)
+        timerStop();
+
+    for (i = S->firstPack; i != S->lastPack; i = (i + 1) % LIMIT_SEQNUM)
+    {
+        if (!S->pktAcked[i] && (!found || S->srDeadline[i] < earliest))
+        {
+            earliest = S->srDeadline[i];
+            found = 1;
+        }
+    }
+
+    if (found)
+        timerStart(earliest > simtime() ? earliest - simtime() : 0);
+}
+
+// Send the next buffered message as a new DATA packet
+void srSendNew(void)
+{
+    struct pkt new_packet;
+
+    // Create DATA packet
+    new_packet.seqnum = S->lastPack;
+    new_packet.acknum = 0;
+    memset(new_packet.payload, 0, sizeof(new_packet.payload));
+    memcpy(new_packet.payload, queueFront()->data, queueFront()->length);
+    new_packet.length = queueFront()->length;
+    new_packet.checksum = calcChecksum(&new_packet);
+
+    // Add to packet buffer and start its logical timer
+    S->txPktBuffer[S->lastPack] = new_packet;
+    S->pktAcked[S->lastPack] = 0;
+    S->srDeadline[S->lastPack] = simtime() + S->rto;
+    rttSent(S->lastPack);
+
+    // Send packet to network
+    ackPiggyback(&new_packet);
+    TRACEF(1, "  %c: Sending new DATA to %c...\n", ME, PEER);
+    TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+    TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+    TRACEF(1, "    PAYLOAD: %.*s\n", 20, new_packet.payload);
+    sendPacket(new_packet);
+
+    // The timer only needs starting if nothing else is pending; otherwise it
+    // already fires at an earlier deadline
+    if (!S->timerRunning)
+        timerStart(S->rto);
+
+    // Update next sequence number and release the message
+    S->lastPack = (S->lastPack + 1) % LIMIT_SEQNUM;
+    queuePop();
+}
+
+// Mark every outstanding packet up to and including `acknum` as received,
+// for a cumulative ACK. Returns how many were not marked before, and sets
+// `sample` to the round trip of `acknum` if that gave one.
+int srAckThrough(int acknum, double *sample)
+{
+    int i, end, count = 0;
+
+    if (!isInFlight(acknum))
+        return 0;
+
+    if (!S->pktAcked[acknum])
+        *sample = rttSample(acknum);
+
+    end = (acknum + 1) % LIMIT_SEQNUM;
+    for (i = S->firstPack; i != end; i = (i + 1) % LIMIT_SEQNUM)
+    {
+        if (!S->pktAcked[i])
+        {
+            S->pktAcked[i] = 1;
+            count++;
+        }
+    }
+    return count;
+}
+
+// Handle an ACK in Selective Repeat mode
+void srAckInput(const struct pkt *packet)
+{
+    double sample = -1;
+    int i, count = 0;
+
+    if (isCorrupt(packet))
+    {
+        // Discard packet
+        TRACEF(1, "  %c: Rejecting ACK from %c... (pending ACK %d)\n", ME, PEER, S->firstPack);
+        return;
+    }
+
+    if (DUPLEX)
+        count += srAckThrough(packet->acknum, &sample);
+    else if (isInFlight(packet->acknum) && !S->pktAcked[packet->acknum])
+    {
+        sample = rttSample(packet->acknum);
+        S->pktAcked[packet->acknum] = 1;
+        count++;
+    }
+    if (isAck(packet))
+        count += sackDecode(packet);
+
+    if (count == 0)
+    {
+        // Nothing new, e.g. a duplicate ACK. DATA whose acknum moves nothing
+        // was not an ACK to reject.
+        if (isAck(packet))
+            TRACEF(1, "  %c: Rejecting ACK from %c... (pending ACK %d)\n", ME, PEER, S->firstPack);
+        return;
+    }
+
+    TRACEF(1, "  %c: Accepting ACK from %c...\n", ME, PEER);
+    windowOnAck(count, sample);
+
+    // The channel is delivering, so give every outstanding packet a full
+    // timeout from now, like a TCP timer restarted on new data. Without
+    // this, packets queued behind others time out before their ACK can
+    // arrive and the resends overload the channel further.
+    for (i = S->firstPack; i != S->lastPack; i = (i + 1) % LIMIT_SEQNUM)
+    {
+        if (!S->pktAcked[i] && S->srDeadline[i] < simtime() + S->rto)
+            S->srDeadline[i] = simtime() + S->rto;
+    }
+
+    // Slide window past every ACKed packet at its base
+    while (S->firstPack != S->lastPack && S->pktAcked[S->firstPack])
+        S->firstPack = (S->firstPack + 1) % LIMIT_SEQNUM;
+
+    // Fill newly available slots with buffered messages
+    while (S->sendQueueLen > 0 && isWithinWindow(S->firstPack, S->lastPack, S->sendWindow))
+        srSendNew();
+
+    srArmTimer();
+}
+
+// Handle the retransmission timer in Selective Repeat mode: resend only
+// expired packets
+void srTimeout(void)
+{
+    struct pkt new_packet;
+    int i;
+
+    rttBackoff();
+    windowOnTimeout();
+
+    for (i = S->firstPack; i != S->lastPack; i = (i + 1) % LIMIT_SEQNUM)
+    {
+        if (S->pktAcked[i] || S->srDeadline[i] > simtime() + SR_DEADLINE_SLACK)
+            continue;
+
+        // Resend packet to network
+        new_packet = S->txPktBuffer[i];
+        ackPiggyback(&new_packet);
+        metrics_retransmit();
+        TRACEF(1, "  %c: Resending DATA to %c...\n", ME, PEER);
+        TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+        TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+        TRACEF(1, "    PAYLOAD: %.*s\n", 20, new_packet.payload);
+        sendPacket(new_packet);
+
+        S->retransmitted[i] = 1;
+        S->srDeadline[i] = simtime() + S->rto;
+    }
+
+    srArmTimer();
+}
+
+// Send an ACK for one sequence number in Selective Repeat mode
+void srSendAck(int seqnum)
+{
+    struct pkt new_packet;
+
+    new_packet.seqnum = 0;
+    new_packet.acknum = seqnum;
+    sackEncode(&new_packet);
+    new_packet.checksum = calcChecksum(&new_packet);
+
+    TRACEF(1, "  %c: Sending ACK to %c...\n", ME, PEER);
+    TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+    TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+    if (TRACE_ON(1))
+        sackPrint(&new_packet);
+    sendPacket(new_packet);
+}
+
+// Handle a DATA packet in Selective Repeat mode
+void srDataInput(const struct pkt *packet)
+{
+    int seqnum = packet->seqnum;
+    int inOrder = seqnum == R->expectSeqNum && !R->rcvValid[seqnum];
+
+    if (isCorrupt(packet) || !isValidLength(packet))
+    {
+        // Corrupted, the sender will resend it when its timer runs out
+        TRACEF(1, "  %c: Rejecting corrupted DATA from %c...\n", ME, PEER);
+        return;
+    }
+
+    if (isWithinWindow(R->expectSeqNum, seqnum, WINDOW_MAX))
+    {
+        // Buffer the message unless it is a duplicate
+        if (!R->rcvValid[seqnum])
+        {
+            R->rcvBuffer[seqnum].length = packet->length;
+            memcpy(R->rcvBuffer[seqnum].data, packet->payload, packet->length);
+            R->rcvValid[seqnum] = 1;
+        }
+
+        // Deliver every in-order message to above
+        while (R->rcvValid[R->expectSeqNum])
+        {
+            deliverMessage(R->rcvBuffer[R->expectSeqNum]);
+            R->rcvValid[R->expectSeqNum] = 0;
+            R->expectSeqNum = (R->expectSeqNum + 1) % LIMIT_SEQNUM;
+        }
+
+        // A duplex run only ACKs cumulatively
+        if (DUPLEX)
+            ackOwe(inOrder);
+        else
+            srSendAck(seqnum);
+    }
+    else if (isWithinWindow((R->expectSeqNum - WINDOW_MAX + LIMIT_SEQNUM) % LIMIT_SEQNUM, seqnum, WINDOW_MAX))
+    {
+        // Already delivered, but the ACK must have been lost
+        if (DUPLEX)
+            ackOwe(0);
+        else
+            srSendAck(seqnum);
+    }
+}
+
+/**** GO-BACK-N ****/
+
 // Called from layer 5, pass the data to be sent to other side
-void A_output(struct msg message)
+void sendOutput(struct msg message)
 {
-    printf("  A: Receiving MSG from above...\n");
-    printf("    DATA: %.*s\n", 20, message.data);
+    TRACEF(1, "  %c: Receiving MSG from above...\n", ME);
+    TRACEF(1, "    DATA: %.*s\n", 20, message.data);
+
+    // Add message to the send queue
+    queuePush(&message);
+
+    if (PROTOCOL == PROTO_SR)
+    {
+        if (isWithinWindow(S->firstPack, S->lastPack, S->sendWindow))
+            srSendNew();
+        else
+            metrics_window_stall();
+        return;
+    }
 
-    // Add message to buffer and update message count
-    msgBuffer[msgCount] = message;
-    msgCount++;
-    
     // Next sequence number is within window
-    if (isWithinWindow(firstPack, lastPack))
+    if (isWithinWindow(S->firstPack, S->lastPack, S->sendWindow))
     {
         struct pkt new_packet;
 
         // Create DATA packet
-        new_packet.seqnum = lastPack;
+        new_packet.seqnum = S->lastPack;
         new_packet.acknum = 0;
-        // Copies message into payload
-        memcpy(new_packet.payload, msgBuffer[nextMsg].data, message.length);
+        // Copies message into payload, zero padded so the checksum never
+        // covers stale bytes
+        memset(new_packet.payload, 0, sizeof(new_packet.payload));
+        memcpy(new_packet.payload, queueFront()->data, queueFront()->length);
         
-        new_packet.checksum = calcChecksum(new_packet);
-        new_packet.length = message.length;
+        new_packet.length = queueFront()->length;
+        new_packet.checksum = calcChecksum(&new_packet);
         // Add to packet buffer
-       txPktBuffer[lastPack] = new_packet;
- 
+       S->txPktBuffer[S->lastPack] = new_packet;
+        S->pktAcked[S->lastPack] = 0;
+        rttSent(S->lastPack);
+
         
         // Send packet to network
-        printf("  A: Sending new DATA to B...\n");
-        printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-        printf("    CHECKSUM: %d\n", new_packet.checksum);
-        printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
+        ackPiggyback(&new_packet);
+        TRACEF(1, "  %c: Sending new DATA to %c...\n", ME, PEER);
+        TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+        TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+        TRACEF(1, "    PAYLOAD: %.*s\n", 20, new_packet.payload);
         //printWindow(firstPack);
-        tolayer3_A(new_packet);
+        sendPacket(new_packet);
 
         // Set timer if packet is first in window
-        if (lastPack == firstPack)
-            starttimer_A(RXMT_TIMEOUT);
+        if (S->lastPack == S->firstPack)
+            timerStart(S->rto);
 
         // Update next sequence number
-        lastPack = (lastPack + 1) % LIMIT_SEQNUM;
+        S->lastPack = (S->lastPack + 1) % LIMIT_SEQNUM;
 
-        // Update next message index
-        nextMsg++;
+        // Release the message
+        queuePop();
+    }
+    else
+    {
+        // Window is full, message waits in the send queue
+        metrics_window_stall();
     }
 }
 
-// Called from layer 3, when a packet arrives for layer 4
-void A_input(struct pkt packet)
+// Handle the ACK a packet from the other entity carries
+void ackInput(const struct pkt *packet)
 {
-    printf("  A: Receiving ACK from B...\n");
-    printf("    SEQ, ACK: %d, %d\n", packet.seqnum, packet.acknum);
-    printf("    CHECKSUM: %d\n", packet.checksum);
-    printf("    PAYLOAD: %.*s\n", 20, packet.payload);
-    //printWindow(firstPack);
+    if (PROTOCOL == PROTO_SR)
+    {
+        srAckInput(packet);
+        return;
+    }
+
+    // Note packets the receiver reports as buffered so a timeout skips them
+    if (!isCorrupt(packet) && isAck(packet))
+        sackDecode(packet);
 
     // No errors and ACK number within window
-    if (calcChecksum(packet) == packet.checksum && isWithinWindow(firstPack, packet.acknum))
+    if (!isCorrupt(packet) && isInFlight(packet->acknum))
     {
-        int i, shift;
+        int shift;
 
-        printf("  A: Accepting ACK from B...\n");
-	printf("    CHECKSUM Calculation: %d\n\n\n\n\n\n\n\n", calcChecksum(packet));
+        TRACEF(1, "  %c: Accepting ACK from %c...\n", ME, PEER);
 
         // Stop timer
-        stoptimer_A();
+        timerStop();
 
         // Find number of times window shifted
-        if (packet.acknum < firstPack)
-            shift = packet.acknum - firstPack + LIMIT_SEQNUM;
+        if (packet->acknum < S->firstPack)
+            shift = packet->acknum - S->firstPack + LIMIT_SEQNUM;
         else
-            shift = packet.acknum - firstPack;
+            shift = packet->acknum - S->firstPack;
+
+        // Update the timeout estimate and the window
+        windowOnAck(shift + 1, rttSample(packet->acknum));
 
         // Update base
-        firstPack = (packet.acknum + 1) % LIMIT_SEQNUM;
+        S->firstPack = (packet->acknum + 1) % LIMIT_SEQNUM;
 
-        // Iterate through newly available slots
-        for (i = 0; i < shift + 1; i++)
+        // Fill newly available slots while outstanding messages are available
+        while (S->sendQueueLen > 0 && isWithinWindow(S->firstPack, S->lastPack, S->sendWindow))
         {
-            // Outstanding messages available
-            if (nextMsg < msgCount)
-            {
-                // Create DATA packet
-                struct pkt new_packet;
-                new_packet.seqnum = lastPack;
-                new_packet.acknum = 0;
-                memcpy(new_packet.payload, msgBuffer[nextMsg].data, msgBuffer[nextMsg].length);
-                new_packet.checksum = calcChecksum(new_packet);
-                new_packet.length = msgBuffer[nextMsg].length;
-                // Add to packet buffer
-                txPktBuffer[lastPack] = new_packet;
-
-                // Send packet to network
-                printf("  A: Sending new DATA to B...\n");
-                printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-                printf("    CHECKSUM: %d\n", new_packet.checksum);
-                printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
-                //printWindow(firstPack);
-                tolayer3_A(new_packet);
-
-                // Update next sequence number
-                lastPack = (lastPack + 1) % LIMIT_SEQNUM;
-
-                // Update next message index
-                nextMsg++;
-            }
+            // Create DATA packet
+            struct pkt new_packet;
+            new_packet.seqnum = S->lastPack;
+            new_packet.acknum = 0;
+            memset(new_packet.payload, 0, sizeof(new_packet.payload));
+            memcpy(new_packet.payload, queueFront()->data, queueFront()->length);
+            new_packet.length = queueFront()->length;
+            new_packet.checksum = calcChecksum(&new_packet);
+            // Add to packet buffer
+            S->txPktBuffer[S->lastPack] = new_packet;
+            S->pktAcked[S->lastPack] = 0;
+            rttSent(S->lastPack);
+
+            // Send packet to network
+            ackPiggyback(&new_packet);
+            TRACEF(1, "  %c: Sending new DATA to %c...\n", ME, PEER);
+            TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+            TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+            TRACEF(1, "    PAYLOAD: %.*s\n", 20, new_packet.payload);
+            //printWindow(firstPack);
+            sendPacket(new_packet);
+
+            // Update next sequence number
+            S->lastPack = (S->lastPack + 1) % LIMIT_SEQNUM;
+
+            // Release the message
+            queuePop();
         }
 
         // Set timer if there are still packets to send
-        if (firstPack != lastPack)
-            starttimer_A(RXMT_TIMEOUT);
+        if (S->firstPack != S->lastPack)
+            timerStart(S->rto);
     }
     else
     {
-        // Discard packet
-        printf("  A: Rejecting ACK from B... (pending ACK %d)\n", firstPack);
+        // Discard packet. DATA whose acknum moves nothing was not an ACK to
+        // reject.
+        if (isAck(packet))
+            TRACEF(1, "  %c: Rejecting ACK from %c... (pending ACK %d)\n", ME, PEER, S->firstPack);
         //printWindow(firstPack);
     }
 }
 
-// Called when A's timer goes off
-void A_timerinterrupt(void)
+// Called when the retransmission timer runs out
+void sendTimeout(void)
 {
     struct pkt new_packet;
-    int i = firstPack;
+    int i = S->firstPack;
 
-    // Iterate through window
-    while (i != lastPack)
+    if (PROTOCOL == PROTO_SR)
     {
-        // Resend packet to network
-        new_packet = txPktBuffer[i];
-        printf("  A: Resending DATA to B...\n");
-        printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-        printf("    CHECKSUM: %d\n", new_packet.checksum);
-        printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
-        //printWindow(firstPack);
-        tolayer3_A(new_packet);
-
-        // Iterate
-        i = (i + 1) % LIMIT_SEQNUM;
+        srTimeout();
+        return;
     }
 
-    // Set timer
-    starttimer_A(RXMT_TIMEOUT);
-}
-// Called when B's timer goes off
-void B_timerinterrupt(void)
-{
-    struct pkt new_packet;
-    int i = firstPack;
-
     // Iterate through window
-    while (i != lastPack)
+    while (i != S->lastPack)
     {
+        // The receiver already has this one buffered
+        if (S->pktAcked[i])
+        {
+            i = (i + 1) % LIMIT_SEQNUM;
+            continue;
+        }
+
         // Resend packet to network
-        new_packet = txPktBuffer[i];
-        printf("  B: Resending DATA to A...\n");
-        printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-        printf("    CHECKSUM: %d\n", new_packet.checksum);
-        printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
+        new_packet = S->txPktBuffer[i];
+        ackPiggyback(&new_packet);
+        metrics_retransmit();
+        TRACEF(1, "  %c: Resending DATA to %c...\n", ME, PEER);
+        TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+        TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+        TRACEF(1, "    PAYLOAD: %.*s\n", 20, new_packet.payload);
         //printWindow(firstPack);
-        tolayer3_B(new_packet);
+        sendPacket(new_packet);
+        S->retransmitted[i] = 1;
 
         // Iterate
         i = (i + 1) % LIMIT_SEQNUM;
     }
 
     // Set timer
-    starttimer_B(RXMT_TIMEOUT);
+    rttBackoff();
+    windowOnTimeout();
+    timerStart(S->rto);
 }
-// Called once before any other entity A routines are called
-void A_init(void)
+
+// Set up the sending half
+void sendInit(void)
 {
-    // Allocate buffers
-    nextMsg = 0;
-    msgCount = 0;
+    // Empty send queue, allocated on first use
+    S->sendQueueHead = 0;
+    S->sendQueueLen = 0;
 
     // State variables
-    firstPack = 0;
-    lastPack = 0;
+    S->firstPack = 0;
+    S->lastPack = 0;
+    S->timerRunning = 0;
+    S->clockRunning = 0;
+    memset(S->pktAcked, 0, sizeof(S->pktAcked));
 
+    // Timeout estimate
+    S->rto = RXMT_TIMEOUT;
+    S->rttSampled = 0;
+
+    // Window
+    windowInit();
 }
 
-// Called from layer 3, when a packet arrives for layer 4 at B
-void B_input(struct pkt packet)
+// Handle the DATA in a packet from the other entity
+void dataInput(const struct pkt *packet)
 {
-    printf("  B: Receiving DATA from A...\n");
-    printf("    SEQ, ACK: %d, %d\n", packet.seqnum, packet.acknum);
-    printf("    CHECKSUM: %d\n", packet.checksum);
-    printf("    PAYLOAD: %.*s\n", 20, packet.payload);
+    if (PROTOCOL == PROTO_SR)
+    {
+        srDataInput(packet);
+        return;
+    }
 
     struct pkt new_packet;
 
     // Packet not corrupted and SEQ number is new
-    if (calcChecksum(packet) == packet.checksum && packet.seqnum == expectSeqNum)
+    if (!isCorrupt(packet) && isValidLength(packet) && packet->seqnum == R->expectSeqNum)
     {
-        // Send message to above
-	struct msg temp;
-	temp.length = packet.length;
-	printf("%i",temp.length);
-	strcpy(temp.data,packet.payload);
-        tolayer5_B(temp);
+        // Send message to above. The payload is not NUL terminated and may
+        // hold any bytes, so copy exactly `length` of them.
+        struct msg temp;
+        temp.length = packet->length;
+        memcpy(temp.data, packet->payload, packet->length);
+        deliverMessage(temp);
+
+        // Record ACK number
+        R->lastAckNum = packet->seqnum;
 
+        // Update expected sequence number
+        R->expectSeqNum = (R->expectSeqNum + 1) % LIMIT_SEQNUM;
+
+        // Deliver messages that arrived ahead of the gap just filled
+        while (R->rcvValid[R->expectSeqNum])
+        {
+            deliverMessage(R->rcvBuffer[R->expectSeqNum]);
+            R->rcvValid[R->expectSeqNum] = 0;
+            R->lastAckNum = R->expectSeqNum;
+            R->expectSeqNum = (R->expectSeqNum + 1) % LIMIT_SEQNUM;
+        }
+
+        // In a duplex run the ACK may wait for DATA to carry it
+        if (DUPLEX)
+        {
+            ackOwe(1);
+            return;
+        }
 
         // Create ACK packet
         new_packet.seqnum = 0;
-        new_packet.acknum = packet.seqnum;
-        memcpy(new_packet.payload, packet.payload, packet.length);
-        new_packet.length = packet.length;
-	new_packet.checksum = calcChecksum(new_packet);
+        new_packet.acknum = R->lastAckNum;
+        sackEncode(&new_packet);
+	new_packet.checksum = calcChecksum(&new_packet);
         // Send packet to network
-        printf("  B: Sending new ACK to A...\n");
-        printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-        printf("    CHECKSUM: %d\n", new_packet.checksum);
-        printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
-        tolayer3_B(new_packet);
-
-        // Record ACK number
-        lastAckNum = new_packet.acknum;
-
-        // Update expected sequence number
-        expectSeqNum = (expectSeqNum + 1) % LIMIT_SEQNUM;
+        TRACEF(1, "  %c: Sending new ACK to %c...\n", ME, PEER);
+        TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+        TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+        if (TRACE_ON(1))
+            sackPrint(&new_packet);
+        sendPacket(new_packet);
     }
 
     // Packet is corrupted or has invalid SEQ number
     else
     {
+        // Keep a packet that arrived ahead of a gap so it need not be resent
+        if (!isCorrupt(packet) && isValidLength(packet) &&
+            isWithinWindow(R->expectSeqNum, packet->seqnum, WINDOW_MAX) && !R->rcvValid[packet->seqnum])
+        {
+            R->rcvBuffer[packet->seqnum].length = packet->length;
+            memcpy(R->rcvBuffer[packet->seqnum].data, packet->payload, packet->length);
+            R->rcvValid[packet->seqnum] = 1;
+        }
+
+        // In a duplex run this only needs the ACK owed
+        if (DUPLEX)
+        {
+            ackOwe(0);
+            return;
+        }
+
         // Create ACK packet for previously acknowledged DATA packet
         new_packet.seqnum = 0;
-        new_packet.acknum = lastAckNum;
-        memcpy(new_packet.payload, packet.payload, packet.length);  
-	new_packet.length = packet.length;
-	new_packet.checksum = calcChecksum(new_packet);
+        new_packet.acknum = R->lastAckNum;
+        sackEncode(&new_packet);
+	new_packet.checksum = calcChecksum(&new_packet);
         // Send packet to network
-        printf("  B: Resending previous ACK to A...\n");
-        printf("    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
-        printf("    CHECKSUM: %d\n", new_packet.checksum);
-        printf("    PAYLOAD: %.*s\n", 20, new_packet.payload);
-        tolayer3_B(new_packet);
+        TRACEF(1, "  %c: Resending previous ACK to %c...\n", ME, PEER);
+        TRACEF(1, "    SEQ, ACK: %d, %d\n", new_packet.seqnum, new_packet.acknum);
+        TRACEF(1, "    CHECKSUM: %d\n", new_packet.checksum);
+        if (TRACE_ON(1))
+            sackPrint(&new_packet);
+        sendPacket(new_packet);
     }
 }
 
+// Set up the receiving half
+void receiveInit(void)
+{
+    // State variables
+    R->expectSeqNum = 0; //Expecting the first packet
+
+    R->lastAckNum = LIMIT_SEQNUM - 1; //Last possible packet to acknowledge
+
+    memset(R->rcvValid, 0, sizeof(R->rcvValid));
+    R->ackOwed = 0;
+}
+
+/**** BOTH HALVES ****/
+
+// Handle a packet from the other entity
+void packetInput(const struct pkt *packet)
+{
+    TRACEF(1, "  %c: Receiving %s from %c...\n", ME, isAck(packet) ? "ACK" : "DATA", PEER);
+    TRACEF(1, "    SEQ, ACK: %d, %d\n", packet->seqnum, packet->acknum);
+    TRACEF(1, "    CHECKSUM: %d\n", packet->checksum);
+    TRACEF(1, "    PAYLOAD: %.*s\n", 20, packet->payload);
+
+    // In a one-way run A only gets ACKs and B only DATA
+    if (!DUPLEX)
+    {
+        if (SIDE == SIDE_A)
+            ackInput(packet);
+        else
+            dataInput(packet);
+        return;
+    }
+
+    // Without a good checksum neither part of the packet can be trusted
+    if (isCorrupt(packet))
+    {
+        TRACEF(1, "  %c: Rejecting corrupted packet from %c...\n", ME, PEER);
+        return;
+    }
+
+    // The DATA goes first, so that DATA sent because of the ACK carries the
+    // ACK for it
+    if (!isAck(packet))
+        dataInput(packet);
+    ackInput(packet);
+}
+
+// Called when the entity's timer goes off: send an ACK that has waited long
+// enough, and handle the retransmission timer if it ran out
+void timerFired(void)
+{
+    float due = S->clockTime;
+
+    S->clockRunning = 0;
+    if (R->ackOwed && R->ackDeadline <= due)
+        ackSend();
+    if (S->timerRunning && S->timerDeadline <= due)
+    {
+        S->timerRunning = 0;
+        sendTimeout();
+    }
+    timerArm();
+}
+
+/**** ENTITY ROUTINES ****/
+
+// The routines the simulator calls. Each selects its own entity and hands
+// over to the code above, which is the same for both.
+
+// Called once before any other entity A routines are called
+void A_init(void)
+{
+    selectSide(SIDE_A);
+    sendInit();
+    receiveInit();
+}
+
+// Called from layer 5, pass the data to be sent to B
+void A_output(struct msg message)
+{
+    selectSide(SIDE_A);
+    sendOutput(message);
+}
+
+// Called from layer 3, when a packet arrives for layer 4
+void A_input(struct pkt packet)
+{
+    A_input_ref(&packet);
+}
+
+// Called from layer 3 with a pointer to the arriving packet
+void A_input_ref(const struct pkt *packet)
+{
+    selectSide(SIDE_A);
+    packetInput(packet);
+}
+
+// Called when A's timer goes off
+void A_timerinterrupt(void)
+{
+    selectSide(SIDE_A);
+    timerFired();
+}
+
+// Tell the simulator whether A can take another message from layer 5
+int A_ready(void)
+{
+    selectSide(SIDE_A);
+    return sendReady();
+}
+
 // Called once before any other entity B routines are called
 void B_init(void)
 {
-    // State variables
-    expectSeqNum = 0; //Expecting the first packet
+    selectSide(SIDE_B);
+    sendInit();
+    receiveInit();
+}
+
+// Called from layer 5 in a duplex run, pass the data to be sent to A
+void B_output(struct msg message)
+{
+    selectSide(SIDE_B);
+    sendOutput(message);
+}
+
+// Called from layer 3, when a packet arrives for layer 4 at B
+void B_input(struct pkt packet)
+{
+    B_input_ref(&packet);
+}
+
+// Called from layer 3 with a pointer to the packet arriving at B
+void B_input_ref(const struct pkt *packet)
+{
+    selectSide(SIDE_B);
+    packetInput(packet);
+}
+
+// Called when B's timer goes off
+void B_timerinterrupt(void)
+{
+    selectSide(SIDE_B);
+    timerFired();
+}
+
+// Tell the simulator whether B can take another message from layer 5
+int B_ready(void)
+{
+    selectSide(SIDE_B);
+    return sendReady();
+}
+
+
+/**** STATE ****/
+
+// Allocate the state of both entities for one simulation
+struct entitystate *entity_create(void)
+{
+    struct entitystate *state = calloc(1, sizeof(struct entitystate));
+
+    if (state == NULL)
+    {
+        printf("Entities: out of memory\n");
+        exit(-1);
+    }
+    return state;
+}
+
+// Make `state` the one the entity routines work on in the calling thread
+void entity_select(struct entitystate *state)
+{
+    E = state;
+    selectSide(SIDE_A);
+}
 
-    lastAckNum = LIMIT_SEQNUM - 1; //Last possible packet to acknowledge
+// Free the state of both entities
+void entity_destroy(struct entitystate *state)
+{
+    if (state == NULL)
+        return;
+    if (E == state)
+    {
+        E = NULL;
+        S = NULL;
+        R = NULL;
+    }
+    free(state->send[SIDE_A].sendQueue);
+    free(state->send[SIDE_B].sendQueue);
+    free(state);
+}
+
+// The state is written as the raw struct followed by the queued messages of
+// A and then B, so it can only be read back by the same build; the size
+// written first catches the obvious mismatches.
+int entity_save(const struct entitystate *state, FILE *file)
+{
+    const struct sender *s;
+    int size = sizeof(struct entitystate);
+    int side, i;
+
+    if (fwrite(&size, sizeof(size), 1, file) != 1 || fwrite(state, sizeof(*state), 1, file) != 1)
+        return -1;
+    for (side = SIDE_A; side <= SIDE_B; side++)
+    {
+        s = &state->send[side];
+        for (i = 0; i < s->sendQueueLen; i++)
+        {
+            if (fwrite(&s->sendQueue[(s->sendQueueHead + i) % s->sendQueueCap], sizeof(struct msg), 1, file) != 1)
+                return -1;
+        }
+    }
+    return 0;
+}
+
+int entity_load(struct entitystate *state, FILE *file)
+{
+    struct sender *s;
+    int size, len[2], side, i;
+
+    if (fread(&size, sizeof(size), 1, file) != 1 || size != (int) sizeof(struct entitystate))
+        return -1;
+    free(state->send[SIDE_A].sendQueue);
+    free(state->send[SIDE_B].sendQueue);
+    if (fread(state, sizeof(*state), 1, file) != 1)
+    {
+        memset(state, 0, sizeof(*state));
+        return -1;
+    }
+
+    // The queues come back unwrapped, with the oldest message in slot 0
+    for (side = SIDE_A; side <= SIDE_B; side++)
+    {
+        s = &state->send[side];
+        len[side] = s->sendQueueLen;
+        s->sendQueue = NULL;
+        s->sendQueueHead = 0;
+        s->sendQueueLen = 0;
+    }
+    for (side = SIDE_A; side <= SIDE_B; side++)
+    {
+        s = &state->send[side];
+        if (s->sendQueueCap > 0)
+        {
+            s->sendQueue = malloc(s->sendQueueCap * sizeof(struct msg));
+            if (s->sendQueue == NULL)
+            {
+                printf("%c: out of memory for the send queue\n", "AB"[side]);
+                exit(-1);
+            }
+        }
+        for (i = 0; i < len[side]; i++)
+        {
+            if (fread(&s->sendQueue[i], sizeof(struct msg), 1, file) != 1)
+                return -1;
+            s->sendQueueLen++;
+        }
+    }
+    return 0;
 }
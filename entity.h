@@ -13,9 +13,52 @@
 // DO NOT MODIFY THIS FILE. All grading will be done with an original copy of
 // this file even if this file is included in the submission.
 
+#include <stdio.h>
+
 #include "simulator.h"
 
 
+/****** PROTOCOL SELECTION ****************************************************/
+
+// Reliable transport protocol run by both entities. Set by the simulator from
+// its `-p` option before `A_init` and `B_init` are called.
+//
+// These settings belong to a run, so like the entity state (see below) they
+// are per thread; the simulator sets them whenever it switches runs.
+#define PROTO_GBN 0       // Go-Back-N (default)
+#define PROTO_SR  1       // Selective Repeat
+
+extern _Thread_local int PROTOCOL;
+
+// Controller that sizes entity "A"'s send window. Set by the simulator from its
+// `-w` option before `A_init` is called.
+#define WIN_FIXED 0       // fixed window of WINDOW_SIZE packets (default)
+#define WIN_AIMD  1       // slow start and additive increase/multiplicative decrease
+#define WIN_DELAY 2       // delay based, grows while the channel queue stays short
+
+extern _Thread_local int WINDOW_CONTROL;
+
+// Most messages an entity keeps waiting for room in its send window before
+// the simulator holds back further input, or 0 for no limit. Set by the
+// simulator from its `-q` option, by default to SEND_QUEUE_DEFAULT: two full
+// windows, so memory follows the window and not the file.
+#define SEND_QUEUE_DEFAULT 128
+extern _Thread_local int SEND_QUEUE_MAX;
+
+// Set by the simulator when the run is duplex: entity "B" has data of its own
+// for "A" (see `B_output`), and both entities piggyback their ACKs on the data
+// they send.
+extern _Thread_local int DUPLEX;
+
+// In a duplex run, the longest an ACK waits for DATA going the other way to
+// carry it before it is sent on its own. Set by the simulator from its `-d`
+// option, by default to the longest time between messages from layer 5 but
+// no more than half of RTO_MAX_DUPLEX, the longest retransmission timeout,
+// so that held ACKs do not make the sender time out.
+extern _Thread_local double ACK_DELAY;
+extern double RTO_MAX_DUPLEX;
+
+
 /****** FUNCTION SIGNATURES ***************************************************/
 
 // These are the public functions provided by the entities that the simulator
@@ -38,9 +81,20 @@ void A_output(struct msg message);
 // being input to entity "A".
 void A_input(struct pkt packet);
 
+// Same as `A_input`, but `packet` points into the simulator's own copy of the
+// packet instead of being passed by value. The simulator calls this instead of
+// `A_input` when built with -DZERO_COPY. The pointer is only valid until the
+// function returns.
+void A_input_ref(const struct pkt *packet);
+
 // This function will be called when entity "A"'s timer has fired.
 void A_timerinterrupt();
 
+// The simulator calls this before handing entity "A" the next message from
+// layer 5. While it returns 0 the message is held back, and it is delivered as
+// soon as the function returns nonzero again.
+int A_ready(void);
+
 
 /**** B ENTITY ****/
 
@@ -53,5 +107,46 @@ void B_init();
 // being input to entity "B".
 void B_input(struct pkt packet);
 
+// Same as `B_input`, but `packet` points into the simulator's own copy of the
+// packet. Called instead of `B_input` when built with -DZERO_COPY. The pointer
+// is only valid until the function returns.
+void B_input_ref(const struct pkt *packet);
+
 // This function will be called when entity "B"'s timer has fired.
 void B_timerinterrupt();
+
+// Only called in a duplex run: layer 5 on the "B" entity has data that should
+// be sent to entity "A".
+void B_output(struct msg message);
+
+// Same as `A_ready`, for the messages layer 5 on "B" hands to `B_output`.
+int B_ready(void);
+
+
+/**** ENTITY STATE ****/
+
+// The entities keep no global state of their own, so several simulations can
+// run at once in different threads. The state of both entities for one
+// simulation lives in an `entitystate`, and the routines above work on the one
+// last selected in the calling thread. The simulator creates and selects one
+// before calling `A_init` and `B_init`.
+
+struct entitystate;
+
+// Allocate the state of both entities for one simulation. It is set up by
+// `A_init` and `B_init` once selected.
+struct entitystate *entity_create(void);
+
+// Make `state` the one the entity routines use in the calling thread.
+void entity_select(struct entitystate *state);
+
+// Free `state`, which must not be used again.
+void entity_destroy(struct entitystate *state);
+
+// Write `state` to `file`, for a checkpoint of the simulation. Returns 0, or
+// -1 if the write failed.
+int entity_save(const struct entitystate *state, FILE *file);
+
+// Replace `state` with one written by `entity_save`. Returns 0, or -1 if the
+// file is short or was written by a build with a different entity state.
+int entity_load(struct entitystate *state, FILE *file);
@@ -0,0 +1,340 @@
+/******************************************************************************/
+/*                                                                            */
+/* RUN METRICS                                                                */
+/*                                                                            */
+/******************************************************************************/
+
+// Latency is kept in an HDR-style log-linear histogram: values (in thousandths
+// of a time unit) are bucketed by their highest set bit and the next
+// LAT_SUB_BITS bits, so every bucket is within 1/8 of its value and the whole
+// range of a 64 bit count fits in a few hundred buckets.
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "metrics.h"
+
+#define LAT_SCALE    1000.0                    // histogram units per time unit
+#define LAT_SUB_BITS 3                         // 8 sub-buckets per power of two
+#define LAT_SUB      (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS  (64 * LAT_SUB)
+
+struct metrics {
+  // Times at which undelivered messages were enqueued, oldest first. This is a
+  // ring buffer that grows when it fills up.
+  float* pending_times;
+  int    pending_head;         // Index of the oldest pending message.
+  int    pending_count;        // Number of pending messages.
+  int    pending_capacity;
+
+  long long msgs_enqueued;
+  long long msgs_delivered;
+  long long bytes_enqueued;
+  long long bytes_delivered;
+  long long reverse_msgs_enqueued;
+  long long reverse_msgs_delivered;
+  long long reverse_bytes_enqueued;
+  long long reverse_bytes_delivered;
+  long long pkts_sent[2];
+  long long timer_expirations[2];
+  long long retransmissions;
+  long long window_stalls;
+
+  unsigned long long lat_counts[LAT_BUCKETS];
+  double lat_sum;
+  double lat_max;
+};
+
+// Metrics of the simulation the calling thread is running.
+_Thread_local struct metrics *mt = NULL;
+
+// Histogram bucket for a latency of `v` units.
+int latbucket(unsigned long long v) {
+  int msb = 0, shift;
+
+  if (v < LAT_SUB) {
+    return (int) v;
+  }
+  while ((v >> msb) > 1) {
+    msb++;
+  }
+  shift = msb - LAT_SUB_BITS;
+  return ((shift + 1) << LAT_SUB_BITS) + (int) ((v >> shift) & (LAT_SUB - 1));
+}
+
+// Smallest latency, in units, that falls in bucket `i`.
+unsigned long long latbucketlow(int i) {
+  int shift;
+
+  if (i < LAT_SUB) {
+    return i;
+  }
+  shift = (i >> LAT_SUB_BITS) - 1;
+  return (unsigned long long) (LAT_SUB + (i & (LAT_SUB - 1))) << shift;
+}
+
+// Middle of bucket `i`, in units. The buckets below LAT_SUB hold one value
+// each, which is exact.
+double latbucketmid(int i) {
+  if (i < LAT_SUB || i == LAT_BUCKETS - 1) {
+    return (double) latbucketlow(i);
+  }
+  return (latbucketlow(i) + latbucketlow(i + 1)) / 2.0;
+}
+
+// Latency (in time units) below which `fraction` of the delivered messages
+// fall, taken as the middle of the bucket it lands in so that it is off by at
+// most half a bucket either way, and never more than the largest latency seen.
+double latpercentile(double fraction) {
+  unsigned long long target, seen = 0;
+  double value;
+  int i;
+
+  if (mt->msgs_delivered == 0) {
+    return 0.0;
+  }
+  target = (unsigned long long) (fraction * mt->msgs_delivered);
+  if (target == 0) {
+    target = 1;
+  }
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    seen += mt->lat_counts[i];
+    if (seen >= target) {
+      value = latbucketmid(i) / LAT_SCALE;
+      return value < mt->lat_max ? value : mt->lat_max;
+    }
+  }
+  return mt->lat_max;
+}
+
+struct metrics *metrics_create() {
+  struct metrics *m = (struct metrics*) calloc(1, sizeof(struct metrics));
+
+  if (m == NULL) {
+    printf("INTERNAL PANIC: out of memory for metrics\n");
+    exit(-1);
+  }
+  return m;
+}
+
+void metrics_select(struct metrics *m) {
+  mt = m;
+}
+
+void metrics_destroy(struct metrics *m) {
+  if (m == NULL) {
+    return;
+  }
+  if (mt == m) {
+    mt = NULL;
+  }
+  free(m->pending_times);
+  free(m);
+}
+
+void metrics_init() {
+  int i;
+
+  free(mt->pending_times);
+  mt->pending_times = NULL;
+  mt->pending_head = mt->pending_count = mt->pending_capacity = 0;
+
+  mt->msgs_enqueued = mt->msgs_delivered = 0;
+  mt->bytes_enqueued = mt->bytes_delivered = 0;
+  mt->reverse_msgs_enqueued = mt->reverse_msgs_delivered = 0;
+  mt->reverse_bytes_enqueued = mt->reverse_bytes_delivered = 0;
+  mt->pkts_sent[0] = mt->pkts_sent[1] = 0;
+  mt->timer_expirations[0] = mt->timer_expirations[1] = 0;
+  mt->retransmissions = 0;
+  mt->window_stalls = 0;
+
+  for (i = 0; i < LAT_BUCKETS; i++) {
+    mt->lat_counts[i] = 0;
+  }
+  mt->lat_sum = 0.0;
+  mt->lat_max = 0.0;
+}
+
+// The struct is written as it is, followed by the pending times oldest first.
+int metrics_save(FILE *file) {
+  int i;
+
+  if (fwrite(mt, sizeof(struct metrics), 1, file) != 1) {
+    return -1;
+  }
+  for (i = 0; i < mt->pending_count; i++) {
+    if (fwrite(&mt->pending_times[(mt->pending_head + i) % mt->pending_capacity],
+               sizeof(float), 1, file) != 1) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+int metrics_load(FILE *file) {
+  float *times = mt->pending_times;
+
+  if (fread(mt, sizeof(struct metrics), 1, file) != 1) {
+    mt->pending_times = times;
+    return -1;
+  }
+  free(times);
+  mt->pending_head  = 0;
+  mt->pending_times = NULL;
+  if (mt->pending_capacity > 0) {
+    mt->pending_times = (float*) malloc(mt->pending_capacity * sizeof(float));
+    if (mt->pending_times == NULL) {
+      printf("INTERNAL PANIC: out of memory for metrics\n");
+      exit(-1);
+    }
+  }
+  if (fread(mt->pending_times, sizeof(float), mt->pending_count, file) !=
+      (size_t) mt->pending_count) {
+    mt->pending_count = 0;
+    return -1;
+  }
+  return 0;
+}
+
+void metrics_enqueue(float time, int length) {
+  float *times;
+  int i;
+
+  if (mt->pending_count == mt->pending_capacity) {
+    // grow the ring, unwrapping it so the oldest message is first again
+    times = (float*) malloc((mt->pending_capacity == 0 ? 1024 : 2 * mt->pending_capacity) * sizeof(float));
+    if (times == NULL) {
+      printf("INTERNAL PANIC: out of memory for metrics\n");
+      exit(-1);
+    }
+    for (i = 0; i < mt->pending_count; i++) {
+      times[i] = mt->pending_times[(mt->pending_head + i) % mt->pending_capacity];
+    }
+    free(mt->pending_times);
+    mt->pending_times = times;
+    mt->pending_head = 0;
+    mt->pending_capacity = (mt->pending_capacity == 0) ? 1024 : 2 * mt->pending_capacity;
+  }
+
+  mt->pending_times[(mt->pending_head + mt->pending_count) % mt->pending_capacity] = time;
+  mt->pending_count++;
+  mt->msgs_enqueued++;
+  mt->bytes_enqueued += length;
+}
+
+void metrics_deliver(float time, int length) {
+  double latency;
+
+  mt->msgs_delivered++;
+  mt->bytes_delivered += length;
+
+  if (mt->pending_count == 0) {
+    // more deliveries than messages sent; there is no latency to record
+    return;
+  }
+  latency = time - mt->pending_times[mt->pending_head];
+  mt->pending_head = (mt->pending_head + 1) % mt->pending_capacity;
+  mt->pending_count--;
+
+  if (latency < 0.0) {
+    latency = 0.0;
+  }
+  mt->lat_counts[latbucket((unsigned long long) (latency * LAT_SCALE))]++;
+  mt->lat_sum += latency;
+  if (latency > mt->lat_max) {
+    mt->lat_max = latency;
+  }
+}
+
+void metrics_enqueue_reverse(int length) {
+  mt->reverse_msgs_enqueued++;
+  mt->reverse_bytes_enqueued += length;
+}
+
+void metrics_deliver_reverse(int length) {
+  mt->reverse_msgs_delivered++;
+  mt->reverse_bytes_delivered += length;
+}
+
+void metrics_sent(int AorB) {
+  mt->pkts_sent[AorB]++;
+}
+
+void metrics_timer_expired(int AorB) {
+  mt->timer_expirations[AorB]++;
+}
+
+void metrics_retransmit() {
+  mt->retransmissions++;
+}
+
+void metrics_window_stall() {
+  mt->window_stalls++;
+}
+
+void metrics_report(FILE *out, float endtime, int nlost, int ncorrupt) {
+  unsigned long long count;
+  long long sent = mt->pkts_sent[0];
+  int i;
+
+  // Both entities send data in a duplex run, so both can retransmit.
+  if (mt->reverse_msgs_enqueued > 0) {
+    sent += mt->pkts_sent[1];
+  }
+
+  fprintf(out, "\n--------------\nRun Statistics:\n");
+  fprintf(out, "  messages from layer5:  %lld (%lld bytes)\n", mt->msgs_enqueued, mt->bytes_enqueued);
+  fprintf(out, "  messages to layer5:    %lld (%lld bytes)\n", mt->msgs_delivered, mt->bytes_delivered);
+  fprintf(out, "  goodput:               %f bytes/time unit\n",
+          endtime > 0.0 ? mt->bytes_delivered / endtime : 0.0);
+  if (mt->reverse_msgs_enqueued > 0) {
+    fprintf(out, "  messages B to A:       %lld (%lld bytes), %lld (%lld bytes) delivered\n",
+            mt->reverse_msgs_enqueued, mt->reverse_bytes_enqueued,
+            mt->reverse_msgs_delivered, mt->reverse_bytes_delivered);
+    fprintf(out, "  goodput B to A:        %f bytes/time unit\n",
+            endtime > 0.0 ? mt->reverse_bytes_delivered / endtime : 0.0);
+  }
+  fprintf(out, "  packets sent by A, B:  %lld, %lld\n", mt->pkts_sent[0], mt->pkts_sent[1]);
+  fprintf(out, "  packets lost:          %d\n", nlost);
+  fprintf(out, "  packets corrupted:     %d\n", ncorrupt);
+  fprintf(out, "  retransmissions:       %lld (ratio %f)\n", mt->retransmissions,
+          sent > 0 ? (double) mt->retransmissions / sent : 0.0);
+  fprintf(out, "  timer expirations A,B: %lld, %lld\n", mt->timer_expirations[0], mt->timer_expirations[1]);
+  fprintf(out, "  window stalls:         %lld\n", mt->window_stalls);
+
+  if (mt->msgs_delivered > 0) {
+    fprintf(out, "  latency mean:          %f\n", mt->lat_sum / mt->msgs_delivered);
+    fprintf(out, "  latency p50, p90, p99: %f, %f, %f (bucket midpoints)\n", latpercentile(0.50),
+            latpercentile(0.90), latpercentile(0.99));
+    fprintf(out, "  latency max:           %f\n", mt->lat_max);
+    fprintf(out, "  latency histogram (lower bound: count):\n");
+    for (i = 0; i < LAT_BUCKETS; i++) {
+      count = mt->lat_counts[i];
+      if (count > 0) {
+        fprintf(out, "    %12.3f: %llu\n", latbucketlow(i) / LAT_SCALE, count);
+      }
+    }
+  }
+  fprintf(out, "--------------\n");
+}
+
+void metrics_summary(struct metricsummary *s) {
+  s->msgs_enqueued       = mt->msgs_enqueued;
+  s->msgs_delivered      = mt->msgs_delivered;
+  s->bytes_enqueued      = mt->bytes_enqueued;
+  s->bytes_delivered     = mt->bytes_delivered;
+  s->reverse_msgs_enqueued   = mt->reverse_msgs_enqueued;
+  s->reverse_msgs_delivered  = mt->reverse_msgs_delivered;
+  s->reverse_bytes_enqueued  = mt->reverse_bytes_enqueued;
+  s->reverse_bytes_delivered = mt->reverse_bytes_delivered;
+  s->pkts_sent[0]        = mt->pkts_sent[0];
+  s->pkts_sent[1]        = mt->pkts_sent[1];
+  s->timer_expirations[0] = mt->timer_expirations[0];
+  s->timer_expirations[1] = mt->timer_expirations[1];
+  s->retransmissions     = mt->retransmissions;
+  s->window_stalls       = mt->window_stalls;
+  s->lat_mean = mt->msgs_delivered > 0 ? mt->lat_sum / mt->msgs_delivered : 0.0;
+  s->lat_p50  = latpercentile(0.50);
+  s->lat_p99  = latpercentile(0.99);
+  s->lat_max  = mt->lat_max;
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* RUN METRICS                                                                */
+/*                                                                            */
+/******************************************************************************/
+
+// Counters and a latency histogram collected during a run and printed by the
+// simulator when it terminates. The simulator records message arrivals,
+// deliveries, packets and timer expirations itself; the entities report the
+// protocol events only they can see (retransmissions and window stalls).
+
+#include <stdio.h>
+
+// The counters of one simulation. Each simulation has its own, so several can
+// run at once in different threads; the functions below record into the one
+// last selected in the calling thread.
+struct metrics;
+
+// Allocate the metrics of one simulation.
+struct metrics *metrics_create();
+
+// Make `m` the metrics recorded into by the calling thread.
+void metrics_select(struct metrics *m);
+
+// Free `m`, which must not be used again.
+void metrics_destroy(struct metrics *m);
+
+// Reset all metrics. Called by the simulator before the run starts.
+void metrics_init();
+
+// A message of `length` bytes was handed to entity "A" by layer 5.
+void metrics_enqueue(float time, int length);
+
+// A message of `length` bytes was handed to layer 5 on entity "B". Messages
+// are delivered in order, so this one belongs to the oldest undelivered
+// enqueue.
+void metrics_deliver(float time, int length);
+
+// The same for the other direction of a duplex run: a message of `length`
+// bytes was handed to "B" by layer 5, or to layer 5 on "A". Only counted; the
+// latency figures are for A to B.
+void metrics_enqueue_reverse(int length);
+void metrics_deliver_reverse(int length);
+
+// Entity `AorB` passed a packet to layer 3.
+void metrics_sent(int AorB);
+
+// The timer of entity `AorB` fired.
+void metrics_timer_expired(int AorB);
+
+// An entity resent a packet it has sent before.
+void metrics_retransmit();
+
+// An entity had to buffer a message because its send window was full.
+void metrics_window_stall();
+
+// Write the metrics to `file`, for a checkpoint of the simulation. Returns 0,
+// or -1 if the write failed.
+int metrics_save(FILE *file);
+
+// Replace the metrics with ones written by metrics_save(). Returns 0, or -1
+// if the file is short.
+int metrics_load(FILE *file);
+
+// Print the end of run report. `endtime` is the final simulator time.
+void metrics_report(FILE *out, float endtime, int nlost, int ncorrupt);
+
+// The headline numbers of a run, for callers that tabulate many runs instead
+// of printing a report for each.
+struct metricsummary {
+  long long msgs_enqueued;
+  long long msgs_delivered;
+  long long bytes_enqueued;
+  long long bytes_delivered;
+  long long reverse_msgs_enqueued;   // B to A, in a duplex run.
+  long long reverse_msgs_delivered;
+  long long reverse_bytes_enqueued;
+  long long reverse_bytes_delivered;
+  long long pkts_sent[2];
+  long long timer_expirations[2];
+  long long retransmissions;
+  long long window_stalls;
+  double lat_mean;
+  double lat_p50;
+  double lat_p99;
+  double lat_max;
+};
+
+// Fill `s` from the selected metrics.
+void metrics_summary(struct metricsummary *s);
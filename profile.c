@@ -0,0 +1,148 @@
+/******************************************************************************/
+/*                                                                            */
+/* EVENT LOOP PROFILE                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+// The profile described in profile.h. Sections nest: each one records how
+// much time its finished children took, through `inner`, and subtracts that
+// from its own.
+
+#include <stdlib.h>
+
+#include "profile.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define PROFILE_UNIT "cycles"
+static inline uint64_t profile_clock(void) {
+  return __rdtsc();
+}
+#else
+#include <time.h>
+#define PROFILE_UNIT "ns"
+static inline uint64_t profile_clock(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+#endif
+
+// Event list lengths are counted in buckets by powers of two: 0, 1, 2-3,
+// 4-7 and so on.
+#define PROF_LENGTH_BUCKETS 33
+
+struct profile {
+  // Time of all sections finished so far, children included. A section
+  // being timed remembers this when it starts; what it has grown by when the
+  // section ends is the time of its children.
+  uint64_t inner;
+
+  uint64_t time[PROF_NSECTIONS];
+  uint64_t calls[PROF_NSECTIONS];
+
+  uint64_t events[3];        // Events handled, by type.
+  uint64_t cancelled;        // Stopped timers thrown away.
+
+  uint64_t lengths[PROF_LENGTH_BUCKETS];
+  uint64_t lengthsum;
+  int      lengthmax;
+};
+
+static const char *sectionnames[PROF_NSECTIONS] = {
+  "event loop", "A_output", "B_output", "A_input", "B_input", "A_timerinterrupt",
+  "B_timerinterrupt", "insertevent", "layer 5 input", "layer 5 output"
+};
+
+// Names of the event types, in the order of the codes in simulator.c.
+static const char *eventnames[3] = {
+  "TIMER_INTERRUPT", "FROM_LAYER5", "FROM_LAYER3"
+};
+
+struct profile *profile_create(void) {
+  return (struct profile*) calloc(1, sizeof(struct profile));
+}
+
+void profile_enter(struct profile *p, struct profmark *m) {
+  m->inner = p->inner;
+  m->start = profile_clock();
+}
+
+void profile_leave(struct profile *p, struct profmark *m, int section) {
+  uint64_t elapsed = profile_clock() - m->start;
+
+  p->time[section] += elapsed - (p->inner - m->inner);
+  if (section != PROF_LOOP) {
+    p->calls[section]++;
+  }
+  p->inner = m->inner + elapsed;
+}
+
+void profile_event(struct profile *p, int evtype, int evcount) {
+  int bucket = 0;
+
+  p->calls[PROF_LOOP]++;
+  if (evtype >= 0 && evtype < 3) {
+    p->events[evtype]++;
+  }
+  while (bucket < PROF_LENGTH_BUCKETS - 1 && (evcount >> bucket) != 0) {
+    bucket++;
+  }
+  p->lengths[bucket]++;
+  p->lengthsum += evcount;
+  if (evcount > p->lengthmax) {
+    p->lengthmax = evcount;
+  }
+}
+
+void profile_cancelled(struct profile *p) {
+  p->cancelled++;
+}
+
+void profile_report(struct profile *p, FILE *out, float time) {
+  uint64_t total = 0, samples = 0;
+  char label[32];
+  int i;
+
+  for (i = 0; i < PROF_NSECTIONS; i++) {
+    total += p->time[i];
+  }
+  for (i = 0; i < PROF_LENGTH_BUCKETS; i++) {
+    samples += p->lengths[i];
+  }
+
+  fprintf(out, " profile at time %f:\n", time);
+  fprintf(out, "   events:");
+  for (i = 0; i < 3; i++) {
+    fprintf(out, " %s %llu,", eventnames[i], (unsigned long long) p->events[i]);
+  }
+  fprintf(out, " stopped timers dropped %llu\n", (unsigned long long) p->cancelled);
+
+  fprintf(out, "   %-18s %12s %16s %12s %7s\n", "section", "calls", PROFILE_UNIT,
+          PROFILE_UNIT "/call", "share");
+  for (i = 0; i < PROF_NSECTIONS; i++) {
+    fprintf(out, "   %-18s %12llu %16llu %12.1f %6.1f%%\n", sectionnames[i],
+            (unsigned long long) p->calls[i], (unsigned long long) p->time[i],
+            p->calls[i] > 0 ? (double) p->time[i] / p->calls[i] : 0.0,
+            total > 0 ? 100.0 * p->time[i] / total : 0.0);
+  }
+
+  fprintf(out, "   event list length: mean %.2f, max %d\n",
+          samples > 0 ? (double) p->lengthsum / samples : 0.0, p->lengthmax);
+  for (i = 0; i < PROF_LENGTH_BUCKETS; i++) {
+    if (p->lengths[i] == 0) {
+      continue;
+    }
+    if (i < 2) {
+      snprintf(label, sizeof(label), "%d", i);
+    } else {
+      snprintf(label, sizeof(label), "%lld-%lld", 1LL << (i - 1), (1LL << i) - 1);
+    }
+    fprintf(out, "     %-23s %12llu %6.1f%%\n", label,
+            (unsigned long long) p->lengths[i], 100.0 * p->lengths[i] / samples);
+  }
+}
+
+void profile_destroy(struct profile *p) {
+  free(p);
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* EVENT LOOP PROFILE                                                         */
+/*                                                                            */
+/******************************************************************************/
+
+// Built-in profile of where a run spends its time, so a slow run can be put
+// down to the scheduler, the protocol or I/O without an external profiler. It
+// records:
+//
+// - how many events of each type were handled, and how many stopped timers
+//   were thrown away;
+// - the time spent in each entity callback, in insertevent, and in reading
+//   input and writing output, and what is left for the event loop itself;
+// - the distribution of the event list's length, sampled at every event.
+//
+// Times are exclusive: a callback's time does not include the insertevent and
+// output calls it makes, which are counted in their own sections. They are in
+// TSC cycles on x86 and in nanoseconds elsewhere.
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Sections time is charged to.
+#define PROF_LOOP        0   // the event loop: removeevent, dispatch, tracing;
+                             // its calls are the events handled
+#define PROF_A_OUTPUT    1   // A_output
+#define PROF_B_OUTPUT    2   // B_output, in a duplex run
+#define PROF_A_INPUT     3   // A_input
+#define PROF_B_INPUT     4   // B_input
+#define PROF_A_TIMER     5   // A_timerinterrupt
+#define PROF_B_TIMER     6   // B_timerinterrupt
+#define PROF_INSERTEVENT 7   // insertevent
+#define PROF_INPUT       8   // reading layer 5 input
+#define PROF_OUTPUT      9   // writing layer 5 output
+#define PROF_NSECTIONS   10
+
+// A section being timed. Filled by profile_enter() and used up by
+// profile_leave().
+struct profmark {
+  uint64_t start;
+  uint64_t inner;
+};
+
+struct profile;
+
+// Allocate an empty profile. Returns NULL if out of memory.
+struct profile *profile_create(void);
+
+// Start timing a section.
+void profile_enter(struct profile *p, struct profmark *m);
+
+// Stop timing the section started with `m`, and charge it to `section`.
+void profile_leave(struct profile *p, struct profmark *m, int section);
+
+// An event of type `evtype` is about to be handled, with `evcount` events
+// left in the event list.
+void profile_event(struct profile *p, int evtype, int evcount);
+
+// A stopped timer was taken off the event list and thrown away.
+void profile_cancelled(struct profile *p);
+
+// Print the profile so far to `out`, headed with the simulation time `time`.
+void profile_report(struct profile *p, FILE *out, float time);
+
+// Free `p`. Does nothing when `p` is NULL.
+void profile_destroy(struct profile *p);
@@ -0,0 +1,54 @@
+/******************************************************************************/
+/*                                                                            */
+/* RANDOM NUMBER STREAMS                                                      */
+/*                                                                            */
+/******************************************************************************/
+
+// xoshiro256** by Blackman and Vigna, seeded through splitmix64 as they
+// recommend, so even seeds that differ in a single bit start far apart.
+
+#include "rng.h"
+
+static uint64_t rotl(uint64_t x, int k) {
+  return (x << k) | (x >> (64 - k));
+}
+
+// One step of splitmix64, used only to expand a seed into a full state.
+static uint64_t splitmix64(uint64_t *x) {
+  uint64_t z = (*x += 0x9e3779b97f4a7c15ULL);
+  z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+  return z ^ (z >> 31);
+}
+
+void rng_seed(struct rng *r, uint64_t seed, uint64_t stream) {
+  uint64_t x;
+  int i;
+
+  // Mix the stream number in first so consecutive streams of one seed do not
+  // share splitmix64 outputs with each other or with neighbouring seeds.
+  x = stream;
+  x = splitmix64(&x) ^ seed;
+  for (i = 0; i < 4; i++) {
+    r->s[i] = splitmix64(&x);
+  }
+}
+
+uint64_t rng_next(struct rng *r) {
+  uint64_t *s = r->s;
+  uint64_t result = rotl(s[1] * 5, 7) * 9;
+  uint64_t t = s[1] << 17;
+
+  s[2] ^= s[0];
+  s[3] ^= s[1];
+  s[1] ^= s[2];
+  s[0] ^= s[3];
+  s[2] ^= t;
+  s[3] = rotl(s[3], 45);
+  return result;
+}
+
+double rng_uniform(struct rng *r) {
+  // the top 53 bits fill the mantissa of a double exactly
+  return (rng_next(r) >> 11) * (1.0 / 9007199254740992.0);
+}
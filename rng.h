@@ -0,0 +1,27 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* RANDOM NUMBER STREAMS                                                      */
+/*                                                                            */
+/******************************************************************************/
+
+// Small, fast generator (xoshiro256**) whose whole state is a `struct rng`, so
+// a simulation can keep as many independent streams as it likes and runs on
+// different threads never touch each other's. A stream is seeded from a run
+// seed and a stream number; different stream numbers give unrelated sequences.
+
+#include <stdint.h>
+
+struct rng {
+  uint64_t s[4];
+};
+
+// Seed `r` as stream `stream` of run seed `seed`.
+void rng_seed(struct rng *r, uint64_t seed, uint64_t stream);
+
+// Next 64 random bits from `r`.
+uint64_t rng_next(struct rng *r);
+
+// Next number from `r`, uniform in [0,1).
+double rng_uniform(struct rng *r);
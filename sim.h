@@ -0,0 +1,129 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* SIMULATION RUNS                                                            */
+/*                                                                            */
+/******************************************************************************/
+
+// Library interface to the simulator, for running simulations from code rather
+// than from the command line. A `sim` holds all state of one run, the
+// simulator's and the entities', so any number of runs may exist at once:
+// interleaved on one thread, or on different threads.
+//
+// A run is created from a `simconfig`, advanced with sim_step_until() (or run
+// to the end in one call with sim_run()), and freed with sim_destroy(). Layer 5
+// data can come from and go to files, or to callbacks for callers that keep
+// it in memory.
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include "channel.h"
+#include "metrics.h"
+
+// Parameters of one run. Start from sim_defaults() and set the fields needed.
+struct simconfig {
+  float lossprob;          // Probability that a packet is dropped.
+  float corruptprob;       // Probability that a packet is corrupted.
+  float lambda;            // Average time between messages from layer 5.
+  int   seed;              // Seed for the random number generator.
+  int   trace;             // Trace level, see trace.h.
+  int   protocol;          // PROTO_* from entity.h.
+  int   windowcontrol;     // WIN_* from entity.h.
+  int   sendqueuemax;      // See SEND_QUEUE_MAX in entity.h.
+  float ackdelay;          // See ACK_DELAY in entity.h; 0 for the default.
+  const char *input;       // File to send from A to B.
+  const char *output;      // File B's data is written to, or NULL to discard it.
+  const char *reverseinput;  // File to send from B to A as well, making the run
+                             // duplex, or NULL.
+  const char *reverseoutput; // File A's data is written to in a duplex run, or
+                             // NULL to discard it.
+  size_t flush;            // Write output every time this many bytes are buffered.
+  const char *tracefile;   // Binary trace file, or NULL for none.
+  int   verify;            // Check B's output against A's input, see verify.h.
+  int   profile;           // Profile the event loop, see profile.h.
+  float profileinterval;   // Also print the profile every this many time units
+                           // while running, or 0 for only in the report.
+  const char *checkpoint;  // File to keep a checkpoint of the run in, or NULL.
+  float checkpointinterval;// Simulated time between checkpoints.
+  const char *resume;      // Checkpoint to continue a run from, or NULL.
+  FILE *report;            // Where sim_run() prints the end-of-run report, or NULL.
+
+  // When set, layer 5 on A asks this for the next message instead of reading
+  // `input`. It copies up to `max` bytes into `data` and returns how many it
+  // copied; fewer than `max` (possibly 0) means this is the last message.
+  // B's input in a duplex run always comes from `reverseinput`.
+  size_t (*readinput)(void *arg, char *data, size_t max);
+
+  // When set, every message B passes to layer 5 is given to this instead of
+  // being written to `output`. `data` is only valid during the call. What A
+  // receives in a duplex run always goes to `reverseoutput`.
+  void (*writeoutput)(void *arg, const char *data, int length);
+
+  void *cbarg;             // Passed to both callbacks.
+
+  // Channel model. Its `lossprob` is ignored in favour of the one above.
+  struct channelconfig channel;
+};
+
+// Counters of a run.
+struct simresult {
+  float endtime;           // Simulation time of the last event handled.
+  int   nsim;              // Messages from layer 5 on A.
+  int   nsimreverse;       // Messages from layer 5 on B, in a duplex run.
+  long long nevents;       // Events handled, not counting stopped timers.
+  int   ntolayer3;         // Packets sent into layer 3.
+  int   nlost;             // Packets lost in the network.
+  int   ncorrupt;          // Packets corrupted by the network.
+  long long divergence;    // First offset where B's output differs from A's
+                           // input, or -1 if it does not or was not checked.
+  long long reversedivergence; // The same for A's output and B's input.
+  struct metricsummary metrics;
+};
+
+struct sim;
+
+// Fill `cfg` with the command line defaults: a perfect Bernoulli channel, a
+// message every 10 time units, seed 0, no tracing, Go-Back-N with a fixed
+// window, and output to "output.dat".
+void sim_defaults(struct simconfig *cfg);
+
+// Set up a run of `cfg`. Returns NULL after printing why if a file could not be
+// opened. `cfg` is not used after the call returns.
+struct sim *sim_create(const struct simconfig *cfg);
+
+// Handle every event of `s` up to and including time `until`. Returns 1 if
+// events remain after that, and 0 once the run has finished.
+int sim_step_until(struct sim *s, float until);
+
+// Current simulation time of `s`.
+float sim_time(struct sim *s);
+
+// Fill `result` with the counters of `s` so far.
+void sim_stats(struct sim *s, struct simresult *result);
+
+// Print the end-of-run report of `s` to `out`.
+void sim_report(struct sim *s, FILE *out);
+
+// Save the full state of `s` to `path`, replacing the file atomically, so the
+// run can later be continued from this point with `resume`. Returns 0, or -1
+// if the file could not be written.
+//
+// A run continued from a checkpoint goes on exactly as the original would
+// have: same events, same random draws, same output. Its settings (channel,
+// protocol, seed, whether it is duplex and so on) and whether it is verified
+// come from the checkpoint; the file names, tracing and profiling come from
+// its own config.
+// Input is read from where the original had got to, and the output file is
+// cut back to what the original had written at the checkpoint. A run using
+// the input or output callbacks must position its own data to match.
+int sim_checkpoint(struct sim *s, const char *path);
+
+// Close the files of `s` and free it.
+void sim_destroy(struct sim *s);
+
+// Run one simulation to completion on the calling thread, print its report if
+// `cfg->report` is set, and fill `result` (if not NULL). Returns 0, or -1 if
+// the run could not be created.
+int sim_run(const struct simconfig *cfg, struct simresult *result);
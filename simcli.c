@@ -0,0 +1,157 @@
+/******************************************************************************/
+/*                                                                            */
+/* SIMULATOR COMMAND LINE                                                     */
+/*                                                                            */
+/******************************************************************************/
+
+// Runs one simulation with the parameters given on the command line. All the
+// work is done through the run API in sim.h; this file only turns the
+// arguments into a `simconfig`.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "entity.h"
+#include "sim.h"
+
+int main(int argc, char* argv[]) {
+  struct simconfig cfg;
+  struct simresult result;
+  int i;
+
+  // Get the command line arguments.
+  //
+  // Command should be:
+  // ./program <loss prob> <corrupt prob> <pkt interval> <seed> <debug> <input file>
+  //
+  // loss prob    : Probability of a packet being lost. 0.0 for no loss. 1.0 for complete loss.
+  // corrupt prob : Probability of a packet being corrupted. 0.0 for no corruption. 1.0 for every packet being corrupted.
+  // pkt interval : Average time between packets being sent from layer5. (> 0.0)
+  // seed         : Value to use as the random seed.
+  // debug        : Level of debugging output requested. 0, 1, 2, or 3.
+  // input file   : Path to file with contents to be transmitted over simulated network.
+  //
+  // Optional arguments may follow the input file:
+  //
+  // -o <file>    : Path of the file the received data is written to. Default "output.dat".
+  // -b <file>    : Also send this file from B to A, with the acknowledgements
+  //                for each direction carried on the other direction's data.
+  // -a <file>    : Path of the file the data A receives from B is written to.
+  //                Discarded unless given.
+  // -d <time>    : In a duplex run, how long an ACK may wait for data going the
+  //                other way to carry it. Default twice <pkt interval>,
+  //                at most 50.
+  // -f <bytes>   : Write received data out every time this many bytes are buffered.
+  //                Default is to write it in blocks of 1 MB.
+  // -t <file>    : Write a binary event trace to this file. Decode it with tracedump.
+  // -p <gbn|sr>  : Protocol run by the entities: Go-Back-N (default) or Selective Repeat.
+  // -w <fixed|aimd|delay> : How entity A sizes its send window. Default fixed.
+  // -q <msgs>    : Hold back input while entity A has this many messages queued.
+  //                Default 128, two full windows; 0 for no limit.
+  // -n <model>   : Channel model, see channel.h. One of
+  //                  bernoulli                  independent losses (default)
+  //                  gilbert[:p,r,h]            Gilbert-Elliott burst losses
+  //                  link[:bandwidth,prop,queue] link with a tail drop queue
+  //                The loss probability applies on top of the model's own drops.
+  // -r <prob>[,<delay>] : Hold back this fraction of packets by up to `delay`
+  //                (default 10) extra time units, letting later ones overtake.
+  // -P <time>    : Profile the event loop and print the profile in the report,
+  //                and also every <time> time units while running unless 0.
+  // -k <file>    : Keep a checkpoint of the run in this file, rewritten every
+  //                -K <time> time units of simulated time (default 1000000).
+  // -R <file>    : Continue the run saved in this checkpoint. The output file
+  //                must be the one the saved run was writing to, and -b and -a
+  //                must be given again for a duplex run. Settings
+  //                given on the command line are replaced by the saved ones.
+  // -v           : Check the data B delivers against the input while running,
+  //                and in a duplex run the data A delivers against B's input.
+  //                Report the result and exit with status 1 if they differ.
+
+  if (argc < 7) {
+    printf("Error: Incorrect number of command line arguments\n");
+    printf("usage: %s <loss prob> <corrupt prob> <pkt interval> <seed> <debug> <input file> [-o <output file>] [-b <reverse input file>] [-a <reverse output file>] [-d <ack delay>] [-f <flush bytes>] [-t <trace file>] [-p <gbn|sr>] [-w <fixed|aimd|delay>] [-q <msgs>] [-n <channel model>] [-r <reorder prob>[,<delay>]] [-v] [-P <time>] [-k <checkpoint file>] [-K <time>] [-R <checkpoint file>]\n", argv[0]);
+    exit(-1);
+  }
+
+  // Parse all command line arguments.
+  sim_defaults(&cfg);
+  sscanf(argv[1], "%f", &cfg.lossprob);
+  sscanf(argv[2], "%f", &cfg.corruptprob);
+  sscanf(argv[3], "%f", &cfg.lambda);
+  sscanf(argv[4], "%d", &cfg.seed);
+  sscanf(argv[5], "%d", &cfg.trace);
+  cfg.input = argv[6];
+  cfg.report = stdout;
+
+  for (i = 7; i < argc; i++) {
+    if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+      cfg.output = argv[++i];
+    } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+      cfg.reverseinput = argv[++i];
+    } else if (strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+      cfg.reverseoutput = argv[++i];
+    } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%f", &cfg.ackdelay);
+    } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%zu", &cfg.flush);
+    } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "gbn") == 0) {
+        cfg.protocol = PROTO_GBN;
+      } else if (strcmp(argv[i], "sr") == 0) {
+        cfg.protocol = PROTO_SR;
+      } else {
+        printf("Error: Unknown protocol %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-w") == 0 && i + 1 < argc) {
+      i++;
+      if (strcmp(argv[i], "fixed") == 0) {
+        cfg.windowcontrol = WIN_FIXED;
+      } else if (strcmp(argv[i], "aimd") == 0) {
+        cfg.windowcontrol = WIN_AIMD;
+      } else if (strcmp(argv[i], "delay") == 0) {
+        cfg.windowcontrol = WIN_DELAY;
+      } else {
+        printf("Error: Unknown window controller %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%d", &cfg.sendqueuemax);
+    } else if (strcmp(argv[i], "-n") == 0 && i + 1 < argc) {
+      i++;
+      if (channel_parse(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad channel model %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+      i++;
+      if (channel_parse_reorder(&cfg.channel, argv[i]) != 0) {
+        printf("Error: Bad reordering %s\n", argv[i]);
+        exit(-1);
+      }
+    } else if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+      cfg.tracefile = argv[++i];
+    } else if (strcmp(argv[i], "-P") == 0 && i + 1 < argc) {
+      cfg.profile = 1;
+      sscanf(argv[++i], "%f", &cfg.profileinterval);
+    } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+      cfg.checkpoint = argv[++i];
+    } else if (strcmp(argv[i], "-K") == 0 && i + 1 < argc) {
+      sscanf(argv[++i], "%f", &cfg.checkpointinterval);
+    } else if (strcmp(argv[i], "-R") == 0 && i + 1 < argc) {
+      cfg.resume = argv[++i];
+    } else if (strcmp(argv[i], "-v") == 0) {
+      cfg.verify = 1;
+    } else {
+      printf("Error: Unknown command line argument %s\n", argv[i]);
+      exit(-1);
+    }
+  }
+
+  if (sim_run(&cfg, &result) != 0) {
+    exit(-1);
+  }
+  return result.divergence >= 0 || result.reversedivergence >= 0 ? 1 : 0;
+}
@@ -10,34 +10,68 @@
 // - Handles the starting/stopping of a timer, and generates timer interrupts
 //   (resulting in calling students timer handler).
 // - Generates message to be sent (passed from later 5 to 4) based on the passed
-//   in input file.
+//   in input file. In a duplex run, B gets messages from a second input file
+//   as well, and A passes what it receives up to layer 5.
 //
 // DO NOT MODIFY THIS FILE. All grading will be done with an original copy of
 // this file even if this file is included in the submission.
 //
+// Building with -DZERO_COPY delivers arriving packets to the entities through
+// `A_input_ref`/`B_input_ref` (a const pointer into the event) instead of
+// copying them into `A_input`/`B_input`.
+//
+// How packets are lost and delayed is decided by the channel model chosen
+// for the run, see channel.h.
+//
+// The simulator is driven through the run API in sim.h. The command line
+// program in simcli.c and the batch runner in batch.c are both built on it.
+//
 // If you're interested in how the simulator is designed, you're welcome to look
 // at the code. However, you shouldn't need to.
 
+// Offsets into the input and output files are 64 bits even where long is not.
+#define _FILE_OFFSET_BITS 64
+
+#include <float.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 #include "simulator.h"
 #include "entity.h"
-
-// Generic event object that is added to a link list and used to represent
+#include "trace.h"
+#include "bintrace.h"
+#include "metrics.h"
+#include "sim.h"
+#include "rng.h"
+#include "channel.h"
+#include "verify.h"
+#include "profile.h"
+
+// Generic event object that is added to the event queue and used to represent
 // the various events: timers, packets, and outgoing messages.
 struct event {
   float evtime;           // event time
   int evtype;             // event type code
   int eventity;           // entity where event occurs
-  struct pkt *pktptr;     // ptr to packet (if any) assoc w/ this event
-  struct event *prev;
-  struct event *next;
+  struct pkt pkt;         // packet (if any) assoc w/ this event
+  unsigned long evseq;    // insertion order, used to break ties on evtime
+  int evindex;            // current position of this event in evlist
+  int evcancelled;        // set when a timer is stopped before it fires
+  struct event *evnext;   // next free event while on the free list
 };
 
-// The event list
-struct event *evlist = NULL;
+// Events are carved out of slabs of EVENT_SLAB_SIZE and recycled through a
+// free list, so a run in steady state does not touch the heap allocator.
+#define EVENT_SLAB_SIZE 1024
+
+struct evslab {
+  struct evslab *next;
+  struct event events[EVENT_SLAB_SIZE];
+};
 
 // Possible events
 #define  TIMER_INTERRUPT 0
@@ -48,80 +82,362 @@ struct event *evlist = NULL;
 #define  A               0
 #define  B               1
 
-// Global state
-int   TRACE = 1;           // How much debugging to display.
-int   nsim = 0;            // Number of messages from 5 to 4 on "A" so far.
-float time = 0.000;        // Current simulator time.
-float lossprob;            // Probability that a packet is dropped.
-float corruptprob;         // Probability that one bit is packet is flipped.
-float lambda;              // Arrival rate of messages from layer 5.
-int   ntolayer3;           // Number of packets sent into layer 3.
-int   nlost;               // Number of packets lost in the network.
-int   ncorrupt;            // Number of packets corrupted by media.
-int   random_seed;         // Seed to use for the random number generator.
-FILE* tx_file;             // File object to be transmitted.
-FILE* rx_file;             // File that will be created with received data.
+// The input file is read in large blocks and handed out to layer 5 in 20 byte
+// messages, instead of one small fread per message.
+#define TX_BLOCK_SIZE (1 << 20)
+
+// Data delivered to layer 5 on "B" (and on "A" in a duplex run) is collected in
+// rx_block and written to rx_file in batches. The block is flushed once it
+// holds rx_flush bytes (or is full), and at termination.
+//
+// Both blocks are only allocated once a file is read or written, so a run that
+// uses the layer 5 callbacks, or discards its output, never pays for them.
+#define RX_BLOCK_SIZE (1 << 20)
+
+// Random number streams. Each entity has its own stream for every kind of
+// random decision, so the draws of one kind never shift those of another: with
+// the same seed, two protocol variants see the same arrivals, and the n-th
+// packet either one sends meets the same loss, delay and corruption. The loss
+// and delay streams belong to the channel, see channel.c.
+#define STREAM_ARRIVAL 0   // time between messages from layer 5
+#define STREAM_CORRUPT 1   // whether and how a packet is corrupted
+#define NSTREAMS       2
+
+// Number rng_seed() gets for stream `s` of entity `AorB`. The numbers missing
+// in between are the channel's.
+#define STREAM_NUMBER(AorB, s) ((AorB) * 4 + ((s) == STREAM_CORRUPT ? 3 : 0))
+
+// All state of one simulation run.
+struct sim {
+  struct evslab *evslabs;  // All slabs allocated so far.
+  struct event *evfree;    // Events available for reuse.
+
+  // The event list. This is a binary min-heap of event pointers ordered by
+  // event time, so inserting and removing an event is O(log n) in the number
+  // of pending events.
+  struct event **evlist;
+  int evcount;             // Number of events currently in the heap.
+  int evcapacity;          // Number of slots allocated for the heap.
+  unsigned long evseq;     // Number of events inserted so far.
+
+  // The pending timer event of each entity, or NULL if its timer is not
+  // running. Stopping a timer only marks the event as cancelled; the main loop
+  // discards it when it reaches the top of the heap.
+  struct event *timerlist[2];
+
+  // The channel model and the state of the channel out of each entity.
+  struct channelconfig chcfg;
+  struct channel channels[2];
+
+  // Set while a message from layer 5 on each entity is being held back
+  // because A_ready() or B_ready() returned 0.
+  int inputheld[2];
+
+  int   trace;             // How much debugging to display. See trace.h.
+  int   protocol;          // Entity settings of this run, see entity.h.
+  int   windowcontrol;
+  int   sendqueuemax;
+  float ackdelay;
+  int   duplex;            // Set when "B" sends data to "A" as well.
+  int   finished;          // Set once the event list has run dry.
+  int   nsim[2];           // Number of messages from 5 to 4 on each entity so far.
+  long long nevents;       // Number of events handled so far.
+  float time;              // Current simulator time.
+  float corruptprob;       // Probability that one bit is packet is flipped.
+  float lambda;            // Arrival rate of messages from layer 5.
+  int   ntolayer3;         // Number of packets sent into layer 3.
+  int   nlost;             // Number of packets lost in the network.
+  int   ncorrupt;          // Number of packets corrupted by media.
+  int   random_seed;       // Seed to use for the random number generator.
+  struct rng streams[2][NSTREAMS]; // Random streams of each entity.
+
+  // Layer 5 of each entity, "A" first. Only "A" has input and only "B" output
+  // unless the run is duplex.
+  FILE* tx_file[2];        // File object to be transmitted, or NULL.
+  FILE* rx_file[2];        // File that will be created with received data, or NULL.
+
+  char  *tx_block[2];      // Block of the input file not yet sent, or NULL.
+  size_t tx_pos[2];        // Next unsent byte in tx_block.
+  size_t tx_end[2];        // Number of valid bytes in tx_block.
+
+  char  *rx_block[2];      // Received data not yet written to rx_file, or NULL.
+  size_t rx_len[2];        // Number of bytes waiting in rx_block.
+  size_t rx_flush;         // Flush threshold, set with "-f".
+
+  // Layer 5 callbacks replacing the input of "A" and the output of "B" when
+  // not NULL.
+  size_t (*input)(void *arg, char *data, size_t max);
+  void (*output)(void *arg, const char *data, int length);
+  void *cbarg;
+
+  struct bintrace *bt;            // Binary trace, or NULL when not tracing.
+  struct verify *verify[2];       // Check of the data each entity sends, or
+                                  // NULL when not verifying.
+  char *verifypath[2];            // Input file of each entity, which its
+                                  // verifier compares against, or NULL.
+  struct profile *prof;           // Event loop profile, or NULL when not profiling.
+  float profinterval;             // Print the profile every this many time units, or 0.
+  float profnext;                 // Time the profile is next printed.
+
+  char *ckpath;                   // Checkpoint file, or NULL for none.
+  float ckinterval;               // Simulated time between checkpoints.
+  float cknext;                   // Time of the next checkpoint.
+  long long txread[2];            // Bytes of layer 5 input read so far.
+  struct metrics *metrics;        // Statistics of this run.
+  struct entitystate *entities;   // State of entities "A" and "B".
+};
+
+// The run the calling thread is executing. The routines the entities call
+// carry no context, so they find their simulation through this.
+_Thread_local struct sim *sim = NULL;
+
+_Thread_local int TRACE = 1;   // Trace level of the current run. See trace.h.
+
+// Run the statement `call`, timing it as profile section `section` when the
+// run is being profiled.
+#define PROFILED(section, call)                         \
+  do {                                                  \
+    if (sim->prof != NULL) {                            \
+      struct profmark mark_;                            \
+      profile_enter(sim->prof, &mark_);                 \
+      call;                                             \
+      profile_leave(sim->prof, &mark_, (section));      \
+    } else {                                            \
+      call;                                             \
+    }                                                   \
+  } while (0)
 
 
 /********* FUNCTION SIGNATURES *********/
 
 void init();
-void generate_next_arrival();
+int simrestore(struct sim *s, const char *path);
+float simrandom(int AorB, int stream);
+void generate_next_arrival(int AorB);
+size_t readinput(int AorB, char *data, size_t max);
+int layer5ready(int AorB);
+void flushoutput();
+void flushrx(int AorB);
+struct event *allocevent();
+void freeevent(struct event *p);
 void insertevent();
+struct event *removeevent(int index);
 void starttimer(int AorB, float increment);
 void stoptimer(int AorB);
 void tolayer3(int AorB, struct pkt packet);
+void tolayer5(int AorB, struct msg message);
+
+
+void sim_defaults(struct simconfig *cfg) {
+  cfg->lossprob    = 0.0;
+  cfg->corruptprob = 0.0;
+  cfg->lambda      = 10.0;
+  cfg->seed        = 0;
+  cfg->trace       = 0;
+  cfg->input       = NULL;
+  cfg->output      = "output.dat";
+  cfg->reverseinput  = NULL;
+  cfg->reverseoutput = NULL;
+  cfg->flush       = RX_BLOCK_SIZE;
+  cfg->tracefile   = NULL;
+  cfg->verify      = 0;
+  cfg->profile     = 0;
+  cfg->profileinterval = 0.0;
+  cfg->checkpoint  = NULL;
+  cfg->checkpointinterval = 1000000.0;
+  cfg->resume      = NULL;
+  cfg->report      = NULL;
+  cfg->protocol    = PROTO_GBN;
+  cfg->windowcontrol = WIN_FIXED;
+  cfg->sendqueuemax  = SEND_QUEUE_DEFAULT;
+  cfg->ackdelay      = 0.0;
+  cfg->readinput   = NULL;
+  cfg->writeoutput = NULL;
+  cfg->cbarg       = NULL;
+  channel_defaults(&cfg->channel);
+}
 
+// Make `s` the run whose state the calling thread works on.
+void simselect(struct sim *s) {
+  sim = s;
+  TRACE = s->trace;
+  PROTOCOL = s->protocol;
+  WINDOW_CONTROL = s->windowcontrol;
+  SEND_QUEUE_MAX = s->sendqueuemax;
+  ACK_DELAY = s->ackdelay;
+  DUPLEX = s->duplex;
+  metrics_select(s->metrics);
+  entity_select(s->entities);
+}
 
-int main(int argc, char* argv[]) {
-  struct event *eventptr;
-  struct msg  msg2give;
-  struct pkt  pkt2give;
+// Release everything a run holds. `s` may be partly set up.
+void simfree(struct sim *s) {
+  int i;
 
-  int i,j;
-  char c;
-
-  // Get the command line arguments.
-  //
-  // Command should be:
-  // ./program <loss prob> <corrupt prob> <pkt interval> <seed> <debug> <input file>
-  //
-  // loss prob    : Probability of a packet being lost. 0.0 for no loss. 1.0 for complete loss.
-  // corrupt prob : Probability of a packet being corrupted. 0.0 for no corruption. 1.0 for every packet being corrupted.
-  // pkt interval : Average time between packets being sent from layer5. (> 0.0)
-  // seed         : Value to use as the random seed.
-  // debug        : Level of debugging output requested. 0, 1, 2, or 3.
-  // input file   : Path to file with contents to be transmitted over simulated network.
-
-  if (argc != 7) {
-    printf("Error: Incorrect number of command line arguments\n");
-    printf("usage: %s <loss prob> <corrupt prob> <pkt interval> <seed> <debug> <input file>\n", argv[0]);
-    exit(-1);
+  for (i = 0; i < 2; i++) {
+    if (s->tx_file[i] != NULL) {
+      fclose(s->tx_file[i]);
+    }
+    if (s->rx_file[i] != NULL) {
+      fclose(s->rx_file[i]);
+    }
+    free(s->tx_block[i]);
+    free(s->rx_block[i]);
+    verify_destroy(s->verify[i]);
+    free(s->verifypath[i]);
+  }
+  bintrace_close(s->bt);
+  profile_destroy(s->prof);
+  free(s->ckpath);
+  free(s->evlist);
+  while (s->evslabs != NULL) {
+    struct evslab *slab = s->evslabs;
+    s->evslabs = slab->next;
+    free(slab);
   }
+  metrics_destroy(s->metrics);
+  entity_destroy(s->entities);
+  if (sim == s) {
+    sim = NULL;
+  }
+  free(s);
+}
 
-  // Parse all command line arguments.
-  sscanf(argv[1], "%f", &lossprob);
-  sscanf(argv[2], "%f", &corruptprob);
-  sscanf(argv[3], "%f", &lambda);
-  sscanf(argv[4], "%d", &random_seed);
-  sscanf(argv[5], "%d", &TRACE);
+struct sim *sim_create(const struct simconfig *cfg) {
+  struct sim *s;
+  int i;
 
+  s = (struct sim*) calloc(1, sizeof(struct sim));
+  if (s == NULL) {
+    printf("INTERNAL PANIC: out of memory for the simulation\n");
+    exit(-1);
+  }
+  s->chcfg       = cfg->channel;
+  s->chcfg.lossprob = cfg->lossprob;
+  s->corruptprob = cfg->corruptprob;
+  s->lambda      = cfg->lambda;
+  s->random_seed = cfg->seed;
+  s->trace       = cfg->trace;
+  s->protocol    = cfg->protocol;
+  s->windowcontrol = cfg->windowcontrol;
+  s->sendqueuemax  = cfg->sendqueuemax;
+  // By default an ACK waits as long as the longest gap between messages from
+  // layer 5 (see generate_next_arrival), so DATA the other way is nearly
+  // always there to carry it, but well inside the sender's timeout.
+  s->ackdelay      = cfg->ackdelay;
+  if (s->ackdelay <= 0.0) {
+    s->ackdelay = 2 * cfg->lambda;
+    if (s->ackdelay > RTO_MAX_DUPLEX / 2) {
+      s->ackdelay = RTO_MAX_DUPLEX / 2;
+    }
+  }
+  s->duplex      = cfg->reverseinput != NULL;
+  s->input       = cfg->readinput;
+  s->output      = cfg->writeoutput;
+  s->cbarg       = cfg->cbarg;
+  s->rx_flush    = cfg->flush;
+  if (s->rx_flush == 0 || s->rx_flush > RX_BLOCK_SIZE) {
+    s->rx_flush = RX_BLOCK_SIZE;
+  }
 
   // Open the file that contains the message that should be transmitted from A
   // to B.
-  tx_file = fopen(argv[6], "rb");
-  if (tx_file == NULL) {
-    printf("Could not open input file.\n");
-    exit(-1);
+  if (s->input == NULL) {
+    s->tx_file[A] = fopen(cfg->input, "rb");
+    if (s->tx_file[A] == NULL) {
+      printf("Could not open input file.\n");
+      simfree(s);
+      return NULL;
+    }
+    // readinput() does its own buffering.
+    setvbuf(s->tx_file[A], NULL, _IONBF, 0);
+  }
+
+  // And the one B transmits to A in a duplex run.
+  if (cfg->reverseinput != NULL) {
+    s->tx_file[B] = fopen(cfg->reverseinput, "rb");
+    if (s->tx_file[B] == NULL) {
+      printf("Could not open reverse input file.\n");
+      simfree(s);
+      return NULL;
+    }
+    setvbuf(s->tx_file[B], NULL, _IONBF, 0);
+  }
+
+  // Open a file to save the received data in. A resumed run keeps what the
+  // run it continues has written so far.
+  if (s->output == NULL && cfg->output != NULL) {
+    s->rx_file[B] = fopen(cfg->output, cfg->resume != NULL ? "r+b" : "wb");
+    if (s->rx_file[B] == NULL) {
+      printf("Could not open output file.\n");
+      simfree(s);
+      return NULL;
+    }
+  }
+  if (cfg->reverseoutput != NULL) {
+    s->rx_file[A] = fopen(cfg->reverseoutput, cfg->resume != NULL ? "r+b" : "wb");
+    if (s->rx_file[A] == NULL) {
+      printf("Could not open reverse output file.\n");
+      simfree(s);
+      return NULL;
+    }
+  }
+
+  if (cfg->tracefile != NULL) {
+    s->bt = bintrace_open(cfg->tracefile);
+    if (s->bt == NULL) {
+      printf("Could not open trace file.\n");
+      simfree(s);
+      return NULL;
+    }
   }
 
-  // Open a file to save the received data in.
-  rx_file = fopen("output.dat", "wb");
-  if (rx_file == NULL) {
-    printf("Could not open output file.\n");
+  // The verifiers read the input files again, as far as they have been
+  // delivered. A's input from a callback can only be checked by hash.
+  if (s->tx_file[A] != NULL) {
+    s->verifypath[A] = strdup(cfg->input);
+  }
+  if (s->tx_file[B] != NULL) {
+    s->verifypath[B] = strdup(cfg->reverseinput);
+  }
+  if ((s->tx_file[A] != NULL && s->verifypath[A] == NULL) ||
+      (s->tx_file[B] != NULL && s->verifypath[B] == NULL)) {
+    printf("INTERNAL PANIC: out of memory for the simulation\n");
     exit(-1);
   }
+  if (cfg->verify) {
+    for (i = 0; i <= s->duplex; i++) {
+      s->verify[i] = verify_create(s->verifypath[i]);
+      if (s->verify[i] == NULL) {
+        printf("Could not start the verifier.\n");
+        simfree(s);
+        return NULL;
+      }
+    }
+  }
 
+  if (cfg->profile) {
+    s->prof = profile_create();
+    if (s->prof == NULL) {
+      printf("INTERNAL PANIC: out of memory for the profile\n");
+      exit(-1);
+    }
+    s->profinterval = cfg->profileinterval > 0.0 ? cfg->profileinterval : 0.0;
+    s->profnext     = s->profinterval;
+  }
+
+  if (cfg->checkpoint != NULL) {
+    s->ckpath = strdup(cfg->checkpoint);
+    if (s->ckpath == NULL) {
+      printf("INTERNAL PANIC: out of memory for the simulation\n");
+      exit(-1);
+    }
+    s->ckinterval = cfg->checkpointinterval > 0.0 ? cfg->checkpointinterval : 1000000.0;
+  }
+
+  s->metrics  = metrics_create();
+  s->entities = entity_create();
+  simselect(s);
 
   // Simulator init.
   init();
@@ -130,24 +446,84 @@ int main(int argc, char* argv[]) {
   A_init();
   B_init();
 
+  // A resumed run then replaces all of that with the state it continues from.
+  if (cfg->resume != NULL && simrestore(s, cfg->resume) != 0) {
+    printf("Could not restore checkpoint %s.\n", cfg->resume);
+    simfree(s);
+    return NULL;
+  }
+
+  // Checkpoints fall on multiples of the interval, whether or not the run was
+  // resumed, so a resumed run takes them where the original would have.
+  if (s->ckpath != NULL) {
+    s->cknext = s->ckinterval;
+    while (s->evcount > 0 && s->cknext <= s->evlist[0]->evtime) {
+      s->cknext += s->ckinterval;
+    }
+  }
+
+  return s;
+}
+
+int sim_step_until(struct sim *s, float until) {
+  struct event *eventptr;
+  struct msg  msg2give;
+#ifndef ZERO_COPY
+  struct pkt  pkt2give;
+#endif
+  struct profmark loopmark;
+  size_t bytes_read;
+
+  int i;
+
+  simselect(s);
+  if (sim->prof != NULL) {
+    profile_enter(sim->prof, &loopmark);
+  }
+
   // Main emulator loop.
-  while (1) {
+  while (!sim->finished) {
     // Get next event to simulate.
-    eventptr = evlist;
-    if (eventptr == NULL) {
+    if (sim->evcount == 0) {
       // There is nothing left to do.
-      goto terminate;
+      flushoutput();
+      sim->finished = 1;
+      break;
+    }
+    if (sim->evlist[0]->evtime > until) {
+      if (sim->prof != NULL) {
+        profile_leave(sim->prof, &loopmark, PROF_LOOP);
+      }
+      return 1;
     }
 
-    // Remove this event from the list by setting the initial pointer to the
-    // next item in the list.
-    evlist = evlist->next;
-    if (evlist != NULL) {
-      // Update our linked list structure if we still have events to do.
-      evlist->prev = NULL;
+    // Take a checkpoint between events, before the first one due at or after
+    // the checkpoint time.
+    if (sim->ckpath != NULL && sim->evlist[0]->evtime >= sim->cknext) {
+      while (sim->cknext <= sim->evlist[0]->evtime) {
+        sim->cknext += sim->ckinterval;
+      }
+      if (sim_checkpoint(sim, sim->ckpath) != 0) {
+        printf("Warning: could not write checkpoint %s\n", sim->ckpath);
+      }
     }
 
-    if (TRACE>=2) {
+    // Remove this event from the heap. The root is always the earliest event.
+    eventptr = removeevent(0);
+    if (eventptr->evcancelled) {
+      // This timer was stopped, so it never fires.
+      if (sim->prof != NULL) {
+        profile_cancelled(sim->prof);
+      }
+      freeevent(eventptr);
+      continue;
+    }
+    sim->nevents++;
+    if (sim->prof != NULL) {
+      profile_event(sim->prof, eventptr->evtype, sim->evcount);
+    }
+
+    if (TRACE_ON(2)) {
       printf("\nEVENT time: %f,",eventptr->evtime);
       printf("  type: %d",eventptr->evtype);
       if (eventptr->evtype==0) {
@@ -161,190 +537,680 @@ int main(int argc, char* argv[]) {
     }
 
     // Update time to next event time.
-    time = eventptr->evtime;
+    sim->time = eventptr->evtime;
+
+    if (sim->profinterval > 0.0 && sim->time >= sim->profnext) {
+      // Charge the loop so far before printing, so the report is up to date.
+      profile_leave(sim->prof, &loopmark, PROF_LOOP);
+      profile_report(sim->prof, stdout, sim->time);
+      profile_enter(sim->prof, &loopmark);
+      while (sim->profnext <= sim->time) {
+        sim->profnext += sim->profinterval;
+      }
+    }
+
+    if (sim->bt != NULL) {
+      bintrace_log(sim->bt, sim->time, TREC_EVENT, eventptr->eventity, 0, eventptr->evtype,
+                   eventptr->evtime,
+                   eventptr->evtype == FROM_LAYER3 ? &eventptr->pkt : NULL);
+    }
 
     // Handle the event correctly.
-    if (eventptr->evtype == FROM_LAYER5 ) {
+    if (eventptr->evtype == FROM_LAYER5 && !layer5ready(eventptr->eventity)) {
+      // The entity's send queue is full. Keep the message in the file until
+      // it has room for it.
+      sim->inputheld[eventptr->eventity] = 1;
+
+    } else if (eventptr->evtype == FROM_LAYER5 ) {
 
       // Copy up to the next 20 bytes of the input file into the message.
-      size_t bytes_read = fread(msg2give.data, 1, 20, tx_file);
+      PROFILED(PROF_INPUT, bytes_read = readinput(eventptr->eventity, msg2give.data, 20));
       msg2give.length = bytes_read;
-      if (bytes_read == 20 && feof(tx_file) == 0) {
-        // If we got the full amount and we are not at the end of the file
-        // then we want to schedule another transmission.
-        generate_next_arrival();
+      if (bytes_read == 20) {
+        // If we got the full amount then there may be more of the file, so
+        // we want to schedule another transmission. Like the end-of-file check
+        // on a 20 byte fread, a file whose size is a multiple of 20 ends with
+        // one empty message.
+        generate_next_arrival(eventptr->eventity);
       }
 
-      if (TRACE>2) {
+      if (TRACE_ON(3)) {
         printf("          MAINLOOP: data given to student: ");
         for (i=0; i<msg2give.length; i++) {
           printf("%c", msg2give.data[i]);
         }
         printf("\n");
       }
-      nsim++;
+      sim->nsim[eventptr->eventity]++;
+      if (sim->verify[eventptr->eventity] != NULL) {
+        verify_sent(sim->verify[eventptr->eventity], msg2give.data, msg2give.length);
+      }
       if (eventptr->eventity == A) {
-        A_output(msg2give);
+        metrics_enqueue(sim->time, msg2give.length);
+        PROFILED(PROF_A_OUTPUT, A_output(msg2give));
+      } else if (sim->duplex) {
+        metrics_enqueue_reverse(msg2give.length);
+        PROFILED(PROF_B_OUTPUT, B_output(msg2give));
       } else {
         printf("INTERNAL ERROR: we should not be passing packets to B output\n");
       }
 
     } else if (eventptr->evtype ==  FROM_LAYER3) {
-      pkt2give.seqnum = eventptr->pktptr->seqnum;
-      pkt2give.acknum = eventptr->pktptr->acknum;
-      pkt2give.checksum = eventptr->pktptr->checksum;
-      pkt2give.length = eventptr->pktptr->length;
-
-      for (i=0; i<20; i++) {
-        pkt2give.payload[i] = eventptr->pktptr->payload[i];
+#ifdef ZERO_COPY
+      // Hand the entity a pointer to the packet stored in the event. The event
+      // is not recycled until the entity returns.
+      if (eventptr->eventity == A) {
+        PROFILED(PROF_A_INPUT, A_input_ref(&eventptr->pkt));
+      } else {
+        PROFILED(PROF_B_INPUT, B_input_ref(&eventptr->pkt));
       }
+#else
+      pkt2give = eventptr->pkt;
 
       // Deliver packet by calling appropriate entity.
       if (eventptr->eventity == A) {
-        A_input(pkt2give);
+        PROFILED(PROF_A_INPUT, A_input(pkt2give));
       } else {
-        B_input(pkt2give);
+        PROFILED(PROF_B_INPUT, B_input(pkt2give));
       }
-      // Free the memory for packet.
-      free(eventptr->pktptr);
+#endif
 
     } else if (eventptr->evtype ==  TIMER_INTERRUPT) {
+      // The timer is no longer running once it has fired.
+      sim->timerlist[eventptr->eventity] = NULL;
+      metrics_timer_expired(eventptr->eventity);
+
       // Call correct entity's timer fired method.
       if (eventptr->eventity == A) {
-        A_timerinterrupt();
+        PROFILED(PROF_A_TIMER, A_timerinterrupt());
       } else {
-        B_timerinterrupt();
+        PROFILED(PROF_B_TIMER, B_timerinterrupt());
       }
     } else {
       printf("INTERNAL PANIC: unknown event type \n");
     }
 
-    free(eventptr);
+    freeevent(eventptr);
+
+    for (i = A; i <= B; i++) {
+      if (sim->inputheld[i] && layer5ready(i)) {
+        // The entity has made room, so the held message arrives now.
+        sim->inputheld[i] = 0;
+        eventptr = allocevent();
+        eventptr->evtime   = sim->time;
+        eventptr->evtype   = FROM_LAYER5;
+        eventptr->eventity = i;
+        insertevent(eventptr);
+      }
+    }
+  }
+  if (sim->prof != NULL) {
+    profile_leave(sim->prof, &loopmark, PROF_LOOP);
+  }
+  return 0;
+}
+
+float sim_time(struct sim *s) {
+  return s->time;
+}
+
+void sim_stats(struct sim *s, struct simresult *result) {
+  simselect(s);
+  result->endtime   = sim->time;
+  result->nsim      = sim->nsim[A];
+  result->nsimreverse = sim->nsim[B];
+  result->nevents   = sim->nevents;
+  result->ntolayer3 = sim->ntolayer3;
+  result->nlost     = sim->nlost;
+  result->ncorrupt  = sim->ncorrupt;
+  result->divergence = sim->verify[A] != NULL ?
+                       verify_divergence(sim->verify[A], sim->finished) : -1;
+  result->reversedivergence = sim->verify[B] != NULL ?
+                              verify_divergence(sim->verify[B], sim->finished) : -1;
+  metrics_summary(&result->metrics);
+}
+
+void sim_report(struct sim *s, FILE *out) {
+  simselect(s);
+  fprintf(out, " Simulator terminated at time %f\n after sending %d msgs from layer5\n", sim->time, sim->nsim[A]);
+  if (sim->duplex) {
+    fprintf(out, " and %d msgs from layer5 on B\n", sim->nsim[B]);
+  }
+  metrics_report(out, sim->time, sim->nlost, sim->ncorrupt);
+  if (sim->verify[A] != NULL) {
+    verify_report(sim->verify[A], out, sim->finished);
+  }
+  if (sim->verify[B] != NULL) {
+    fprintf(out, " from B to A:\n");
+    verify_report(sim->verify[B], out, sim->finished);
+  }
+  if (sim->prof != NULL) {
+    profile_report(sim->prof, out, sim->time);
+  }
+}
+
+void sim_destroy(struct sim *s) {
+  if (s != NULL) {
+    simfree(s);
+  }
+}
+
+int sim_run(const struct simconfig *cfg, struct simresult *result) {
+  struct sim *s;
+
+  s = sim_create(cfg);
+  if (s == NULL) {
+    return -1;
+  }
+  while (sim_step_until(s, FLT_MAX)) {
+  }
+  if (cfg->report != NULL) {
+    sim_report(s, cfg->report);
+  }
+  if (result != NULL) {
+    sim_stats(s, result);
+  }
+  sim_destroy(s);
+  return 0;
+}
+
+/****** CHECKPOINTS ******/
+
+// A checkpoint holds everything needed to carry on with a run exactly as it
+// would have gone on: the fields of `struct sim` listed below, the pending
+// events in heap order, how far the input has been read and the output
+// written, and the state of the entities, the metrics and the verifier. It is
+// written with fwrite as it is in memory, so it can only be read back by the
+// same build on the same machine. The binary trace and the profile are not
+// kept; a resumed run starts both afresh.
+
+#define CKPT_MAGIC   "RDTCKPT"
+#define CKPT_VERSION 2
+
+static void evplace(struct event *p, int index);
+
+// The fields of `struct sim` saved as they are.
+#define CKPT_FIELD(name) { offsetof(struct sim, name), sizeof(((struct sim*) 0)->name) }
+static const struct {
+  size_t offset;
+  size_t size;
+} ckfields[] = {
+  CKPT_FIELD(time),      CKPT_FIELD(nsim),          CKPT_FIELD(nevents),
+  CKPT_FIELD(ntolayer3), CKPT_FIELD(nlost),         CKPT_FIELD(ncorrupt),
+  CKPT_FIELD(evseq),     CKPT_FIELD(inputheld),     CKPT_FIELD(txread),
+  CKPT_FIELD(corruptprob), CKPT_FIELD(lambda),      CKPT_FIELD(random_seed),
+  CKPT_FIELD(protocol),  CKPT_FIELD(windowcontrol), CKPT_FIELD(sendqueuemax),
+  CKPT_FIELD(ackdelay),  CKPT_FIELD(duplex),      CKPT_FIELD(streams),
+  CKPT_FIELD(chcfg),     CKPT_FIELD(channels),
+};
+#define CKPT_NFIELDS ((int) (sizeof(ckfields) / sizeof(ckfields[0])))
+
+// Write the selected run to `f`. Returns 0, or -1 if a write failed.
+static int simsave(FILE *f) {
+  char magic[8] = CKPT_MAGIC;
+  int version = CKPT_VERSION, evsize = sizeof(struct event);
+  int i, timer[2], hasverify[2];
+  long long rxwritten[2];
+  int err = 0;
+
+  for (i = 0; i < 2; i++) {
+    rxwritten[i] = sim->rx_file[i] != NULL ? (long long) ftello(sim->rx_file[i]) : -1;
+    hasverify[i] = sim->verify[i] != NULL;
+  }
+
+  err |= fwrite(magic, sizeof(magic), 1, f) != 1;
+  err |= fwrite(&version, sizeof(version), 1, f) != 1;
+  err |= fwrite(&evsize, sizeof(evsize), 1, f) != 1;
+  for (i = 0; i < CKPT_NFIELDS; i++) {
+    err |= fwrite((char*) sim + ckfields[i].offset, ckfields[i].size, 1, f) != 1;
+  }
+
+  err |= fwrite(&sim->evcount, sizeof(sim->evcount), 1, f) != 1;
+  for (i = 0; i < sim->evcount; i++) {
+    err |= fwrite(sim->evlist[i], sizeof(struct event), 1, f) != 1;
+  }
+  for (i = 0; i < 2; i++) {
+    timer[i] = sim->timerlist[i] != NULL ? sim->timerlist[i]->evindex : -1;
+  }
+  err |= fwrite(timer, sizeof(timer), 1, f) != 1;
+
+  err |= fwrite(rxwritten, sizeof(rxwritten), 1, f) != 1;
+  err |= entity_save(sim->entities, f) != 0;
+  err |= metrics_save(f) != 0;
+  err |= fwrite(hasverify, sizeof(hasverify), 1, f) != 1;
+  for (i = 0; i < 2; i++) {
+    if (hasverify[i]) {
+      err |= verify_save(sim->verify[i], f) != 0;
+    }
+  }
+  return err ? -1 : 0;
+}
+
+int sim_checkpoint(struct sim *s, const char *path) {
+  char *tmp;
+  FILE *f;
+  int i, err;
+
+  simselect(s);
+
+  // Everything received so far goes to disk first, so the output file holds
+  // exactly what the checkpoint says has been written.
+  flushoutput();
+  for (i = 0; i < 2; i++) {
+    if (sim->rx_file[i] != NULL &&
+        (fflush(sim->rx_file[i]) != 0 || fsync(fileno(sim->rx_file[i])) != 0)) {
+      return -1;
+    }
   }
 
-terminate:
-  fclose(tx_file);
-  fclose(rx_file);
-  printf(" Simulator terminated at time %f\n after sending %d msgs from layer5\n", time, nsim);
+  // Write a new file and rename it over the old one, so that a crash while
+  // writing leaves the previous checkpoint intact.
+  tmp = (char*) malloc(strlen(path) + 5);
+  if (tmp == NULL) {
+    return -1;
+  }
+  sprintf(tmp, "%s.tmp", path);
+  f = fopen(tmp, "wb");
+  if (f == NULL) {
+    free(tmp);
+    return -1;
+  }
+  err = simsave(f);
+  if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+    err = -1;
+  }
+  if (fclose(f) != 0) {
+    err = -1;
+  }
+  if (err == 0 && rename(tmp, path) != 0) {
+    err = -1;
+  }
+  if (err != 0) {
+    remove(tmp);
+  }
+  free(tmp);
+  return err;
+}
+
+// Read the run in `f` into the selected run. Returns 0, or -1 if the file is
+// not a checkpoint of this build or is cut short.
+static int simload(FILE *f) {
+  char magic[8];
+  int version, evsize, count, i, timer[2], hasverify[2];
+  long long rxwritten[2];
+  struct event *p, **newlist;
+
+  if (fread(magic, sizeof(magic), 1, f) != 1 || memcmp(magic, CKPT_MAGIC, sizeof(magic)) != 0 ||
+      fread(&version, sizeof(version), 1, f) != 1 || version != CKPT_VERSION ||
+      fread(&evsize, sizeof(evsize), 1, f) != 1 || evsize != (int) sizeof(struct event)) {
+    return -1;
+  }
+  for (i = 0; i < CKPT_NFIELDS; i++) {
+    if (fread((char*) sim + ckfields[i].offset, ckfields[i].size, 1, f) != 1) {
+      return -1;
+    }
+  }
+
+  // The events go back into the same heap slots, so the heap is exactly the
+  // one saved and ties between events break the same way.
+  if (fread(&count, sizeof(count), 1, f) != 1 || count < 0) {
+    return -1;
+  }
+  if (count > sim->evcapacity) {
+    newlist = (struct event**) realloc(sim->evlist, count * sizeof(struct event*));
+    if (newlist == NULL) {
+      printf("INTERNAL PANIC: out of memory for the event list\n");
+      exit(-1);
+    }
+    sim->evlist = newlist;
+    sim->evcapacity = count;
+  }
+  for (i = 0; i < count; i++) {
+    p = allocevent();
+    if (fread(p, sizeof(struct event), 1, f) != 1) {
+      freeevent(p);
+      return -1;
+    }
+    p->evnext = NULL;
+    evplace(p, sim->evcount++);
+  }
+  if (fread(timer, sizeof(timer), 1, f) != 1) {
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (timer[i] >= count) {
+      return -1;
+    }
+    sim->timerlist[i] = timer[i] >= 0 ? sim->evlist[timer[i]] : NULL;
+  }
+
+  // Carry on reading the input where the run had got to, and writing the
+  // output after what it had written. A duplex run can not go on without
+  // B's input.
+  if (fread(rxwritten, sizeof(rxwritten), 1, f) != 1) {
+    return -1;
+  }
+  if (sim->duplex && sim->tx_file[B] == NULL) {
+    return -1;
+  }
+  for (i = 0; i < 2; i++) {
+    if (sim->tx_file[i] != NULL) {
+      if (fseeko(sim->tx_file[i], (off_t) sim->txread[i], SEEK_SET) != 0) {
+        return -1;
+      }
+      sim->tx_pos[i] = 0;
+      sim->tx_end[i] = 0;
+    }
+    if (sim->rx_file[i] != NULL) {
+      if (rxwritten[i] < 0) {
+        rxwritten[i] = 0;
+      }
+      if (ftruncate(fileno(sim->rx_file[i]), (off_t) rxwritten[i]) != 0 ||
+          fseeko(sim->rx_file[i], (off_t) rxwritten[i], SEEK_SET) != 0) {
+        return -1;
+      }
+    }
+    sim->rx_len[i] = 0;
+  }
+
+  if (entity_load(sim->entities, f) != 0 || metrics_load(f) != 0 ||
+      fread(hasverify, sizeof(hasverify), 1, f) != 1) {
+    return -1;
+  }
+
+  // The run is verified if the one saved was, as the bytes already passed
+  // can not be checked otherwise.
+  for (i = 0; i < 2; i++) {
+    if (hasverify[i] && sim->verify[i] == NULL) {
+      sim->verify[i] = verify_create(sim->verifypath[i]);
+      if (sim->verify[i] == NULL) {
+        return -1;
+      }
+    } else if (!hasverify[i] && sim->verify[i] != NULL) {
+      verify_destroy(sim->verify[i]);
+      sim->verify[i] = NULL;
+    }
+    if (hasverify[i] && verify_load(sim->verify[i], f) != 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+// Replace the state of run `s`, just set up, with the checkpoint at `path`.
+int simrestore(struct sim *s, const char *path) {
+  FILE *f;
+  int err;
+
+  simselect(s);
+
+  // Drop what init() and the entities' init routines scheduled.
+  while (sim->evcount > 0) {
+    freeevent(removeevent(0));
+  }
+  sim->timerlist[A] = NULL;
+  sim->timerlist[B] = NULL;
+
+  f = fopen(path, "rb");
+  if (f == NULL) {
+    return -1;
+  }
+  err = simload(f);
+  fclose(f);
+
+  // The settings of the run may have come from the checkpoint.
+  simselect(s);
+  return err;
 }
 
 // Initialize the simulator.
 void init() {
-  int i;
-  float sum, avg;
-  float jimsrand();
+  int i, j;
 
-  // init random number generator
-  srand(random_seed);
-
-  // test random number generator for students
-  sum = 0.0;
-  for (i=0; i<1000; i++) {
-    sum=sum+jimsrand();    // jimsrand() should be uniform in [0,1]
+  // init random number streams
+  for (i = 0; i < 2; i++) {
+    for (j = 0; j < NSTREAMS; j++) {
+      rng_seed(&sim->streams[i][j], (uint64_t) (unsigned int) sim->random_seed,
+               STREAM_NUMBER(i, j));
+    }
+    channel_init(&sim->channels[i], (unsigned int) sim->random_seed, i);
   }
-  avg = sum/1000.0;
-  if (avg < 0.25 || avg > 0.75) {
-    printf("It is likely that random number generation on your machine\n" );
-    printf("is different from what this simulator expects.  Please take\n");
-    printf("a look at the routine jimsrand() in the simulator code. Sorry. \n");
-    exit(0);
+
+  sim->ntolayer3 = 0;
+  sim->nlost     = 0;
+  sim->ncorrupt  = 0;
+  sim->time      = 0.0;             // initialize time to 0.0
+  metrics_init();
+
+  generate_next_arrival(A);     // initialize event list
+  if (sim->duplex) {
+    generate_next_arrival(B);
   }
+}
 
-  ntolayer3 = 0;
-  nlost     = 0;
-  ncorrupt  = 0;
-  time      = 0.0;             // initialize time to 0.0
+// Return a float in range [0,1) from stream `stream` of entity `AorB`. All
+// random numbers the simulator uses come from here.
+float simrandom(int AorB, int stream) {
+  return (float) rng_uniform(&sim->streams[AorB][stream]);
+}
 
-  generate_next_arrival();     // initialize event list
+// Copy up to `max` bytes of the input file of entity `AorB` into `data`,
+// refilling its tx_block from the file as needed. Returns the number of bytes
+// copied, which is only less than `max` at the end of the file. A run with an
+// input callback asks it instead for A's input.
+size_t readinput(int AorB, char *data, size_t max) {
+  size_t n = 0, chunk;
+
+  if (AorB == A && sim->input != NULL) {
+    n = sim->input(sim->cbarg, data, max);
+    sim->txread[A] += n;
+    return n;
+  }
+
+  if (sim->tx_block[AorB] == NULL) {
+    sim->tx_block[AorB] = (char*) malloc(TX_BLOCK_SIZE);
+    if (sim->tx_block[AorB] == NULL) {
+      printf("INTERNAL PANIC: out of memory for the input\n");
+      exit(-1);
+    }
+  }
+  while (n < max) {
+    if (sim->tx_pos[AorB] == sim->tx_end[AorB]) {
+      sim->tx_end[AorB] = fread(sim->tx_block[AorB], 1, TX_BLOCK_SIZE, sim->tx_file[AorB]);
+      sim->tx_pos[AorB] = 0;
+      if (sim->tx_end[AorB] == 0) {
+        break;
+      }
+    }
+    chunk = sim->tx_end[AorB] - sim->tx_pos[AorB];
+    if (chunk > max - n) {
+      chunk = max - n;
+    }
+    memcpy(data + n, sim->tx_block[AorB] + sim->tx_pos[AorB], chunk);
+    n      += chunk;
+    sim->tx_pos[AorB] += chunk;
+  }
+  sim->txread[AorB] += n;
+  return n;
 }
 
-// Return a float in range [0,1]. The routine below is used to
-// isolate all random number generation in one location. We assume that the
-// system-supplied rand() function return an int in therange [0,mmm].
-float jimsrand() {
-  double mmm = 2147483647;   // largest int  - MACHINE DEPENDENT!!!!!!!!
-  float x;                   // individual students may need to change mmm
-  x = rand()/mmm;            // x should be uniform in [0,1]
-  return x;
+// Whether entity `AorB` can take the next message from layer 5 now.
+int layer5ready(int AorB) {
+  return AorB == A ? A_ready() : B_ready();
 }
 
 /************ EVENT HANDLING ROUTINES ****************/
 /*  The next set of routines handle the event list   */
 /*****************************************************/
 
-// Generate a new event from layer 5 to A (the sending side). This just adds
-// an event at a particular time to the simulator, the content is filled in
-// when this event is actually processed.
-void generate_next_arrival() {
+// Generate a new event from layer 5 to `AorB` (a sending side: only A unless
+// the run is duplex). This just adds an event at a particular time to the
+// simulator, the content is filled in when this event is actually processed.
+void generate_next_arrival(int AorB) {
   double x;
   struct event *evptr;
   float ttime;
   int tempint;
 
-  if (TRACE > 2) {
+  if (TRACE_ON(3)) {
     printf("          GENERATE NEXT ARRIVAL: creating new arrival\n");
   }
 
   // x is uniform on [0,2*lambda], having mean of lambda.
-  x = lambda * jimsrand() * 2;
+  x = sim->lambda * simrandom(AorB, STREAM_ARRIVAL) * 2;
 
-  evptr = (struct event*) malloc(sizeof(struct event));
+  evptr = allocevent();
 
   // This gets triggered at some random, but bounded, time in the future.
-  evptr->evtime   = time + x;
+  evptr->evtime   = sim->time + x;
   evptr->evtype   = FROM_LAYER5;
-  evptr->eventity = A;
+  evptr->eventity = AorB;
 
   insertevent(evptr);
 }
 
+// Take an event from the free list, allocating a new slab when it is empty.
+struct event *allocevent() {
+  struct evslab *slab;
+  struct event *p;
+  int i;
+
+  if (sim->evfree == NULL) {
+    slab = (struct evslab*) malloc(sizeof(struct evslab));
+    if (slab == NULL) {
+      printf("INTERNAL PANIC: out of memory for events\n");
+      exit(-1);
+    }
+    slab->next = sim->evslabs;
+    sim->evslabs = slab;
+    for (i = EVENT_SLAB_SIZE - 1; i >= 0; i--) {
+      slab->events[i].evnext = sim->evfree;
+      sim->evfree = &slab->events[i];
+    }
+  }
+
+  p = sim->evfree;
+  sim->evfree = p->evnext;
+  return p;
+}
+
+// Return an event to the free list once it has been handled.
+void freeevent(struct event *p) {
+  p->evnext = sim->evfree;
+  sim->evfree = p;
+}
+
+// Returns true if event `p` should be handled before event `q`. Events with
+// the same time are handled newest first, which is the order the original
+// sorted linked list produced, so traces do not change.
+static int evbefore(struct event *p, struct event *q) {
+  if (p->evtime != q->evtime) {
+    return p->evtime < q->evtime;
+  }
+  return p->evseq > q->evseq;
+}
+
+// Store an event at a position in the heap and keep its index up to date.
+static void evplace(struct event *p, int index) {
+  sim->evlist[index] = p;
+  p->evindex = index;
+}
+
+// Move the event at `index` towards the root until the heap is ordered.
+static void evsiftup(int index) {
+  struct event *p = sim->evlist[index];
+  int parent;
+
+  while (index > 0) {
+    parent = (index - 1) / 2;
+    if (!evbefore(p, sim->evlist[parent])) {
+      break;
+    }
+    evplace(sim->evlist[parent], index);
+    index = parent;
+  }
+  evplace(p, index);
+}
+
+// Move the event at `index` towards the leaves until the heap is ordered.
+static void evsiftdown(int index) {
+  struct event *p = sim->evlist[index];
+  int child;
+
+  while ((child = 2 * index + 1) < sim->evcount) {
+    if (child + 1 < sim->evcount && evbefore(sim->evlist[child + 1], sim->evlist[child])) {
+      child++;
+    }
+    if (!evbefore(sim->evlist[child], p)) {
+      break;
+    }
+    evplace(sim->evlist[child], index);
+    index = child;
+  }
+  evplace(p, index);
+}
+
 void insertevent(struct event *p) {
-  struct event *q, *qold;
+  struct event **newlist;
+  struct profmark mark;
 
-  if (TRACE > 2) {
-    printf("            INSERTEVENT: time is %lf\n",time);
+  if (sim->prof != NULL) {
+    profile_enter(sim->prof, &mark);
+  }
+  if (TRACE_ON(3)) {
+    printf("            INSERTEVENT: time is %lf\n",sim->time);
     printf("            INSERTEVENT: future time will be %lf\n",p->evtime);
   }
 
-  // q points to header of list in which p struct inserted
-  q = evlist;
+  // grow the heap if it is full
+  if (sim->evcount == sim->evcapacity) {
+    sim->evcapacity = (sim->evcapacity == 0) ? 64 : sim->evcapacity * 2;
+    newlist = (struct event**) realloc(sim->evlist, sim->evcapacity * sizeof(struct event*));
+    if (newlist == NULL) {
+      printf("INTERNAL PANIC: out of memory for the event list\n");
+      exit(-1);
+    }
+    sim->evlist = newlist;
+  }
 
-  if (q == NULL) {
-    // list is empty
-    evlist=p;
-    p->next=NULL;
-    p->prev=NULL;
+  if (sim->bt != NULL) {
+    bintrace_log(sim->bt, sim->time, TREC_INSERT, p->eventity, 0, p->evtype, p->evtime,
+                 p->evtype == FROM_LAYER3 ? &p->pkt : NULL);
+  }
 
-  } else {
-    for (qold = q; q !=NULL && p->evtime > q->evtime; q=q->next) {
-      qold = q;
-    }
-    if (q==NULL) {
-      // end of list
-      qold->next = p;
-      p->prev = qold;
-      p->next = NULL;
-    } else if (q == evlist) {
-      // front of list
-      p->next=evlist;
-      p->prev=NULL;
-      p->next->prev=p;
-      evlist = p;
-    } else {
-      // middle of list
-      p->next=q;
-      p->prev=q->prev;
-      q->prev->next=p;
-      q->prev=p;
-    }
+  p->evseq = sim->evseq++;
+  p->evcancelled = 0;
+  evplace(p, sim->evcount++);
+  evsiftup(p->evindex);
+  if (sim->prof != NULL) {
+    profile_leave(sim->prof, &mark, PROF_INSERTEVENT);
   }
 }
 
+// Remove the event at position `index` in the heap and return it.
+struct event *removeevent(int index) {
+  struct event *p = sim->evlist[index];
+
+  sim->evcount--;
+  if (index != sim->evcount) {
+    // fill the hole with the last event and restore the heap order around it
+    evplace(sim->evlist[sim->evcount], index);
+    evsiftup(index);
+    evsiftdown(sim->evlist[index]->evindex);
+  }
+  return p;
+}
+
+// Print the pending events. They are listed in heap order, not time order.
 void printevlist() {
   struct event *q;
   int i;
   printf("--------------\nEvent List Follows:\n");
-  for(q = evlist; q!=NULL; q=q->next) {
+  for (i = 0; i < sim->evcount; i++) {
+    q = sim->evlist[i];
+    if (q->evcancelled) {
+      continue;
+    }
     printf("Event time: %f, type: %d entity: %d\n", q->evtime, q->evtype, q->eventity);
   }
   printf("--------------\n");
@@ -378,57 +1244,47 @@ void tolayer3_B(struct pkt packet) {
   tolayer3(B, packet);
 }
 
+float simtime() {
+  return sim->time;
+}
+
 void starttimer(int AorB, float increment) {
-  struct event *q;
   struct event *evptr;
 
-  if (TRACE>2) {
-    printf("          START TIMER: starting timer at %f\n",time);
+  if (TRACE_ON(3)) {
+    printf("          START TIMER: starting timer at %f\n",sim->time);
   }
   // be nice: check to see if timer is already started, if so, then warn
-  for (q=evlist; q!=NULL ; q = q->next) {
-    if ( (q->evtype == TIMER_INTERRUPT && q->eventity == AorB) ) {
-      printf("Warning: attempt to start a timer that is already started\n");
-      return;
-    }
+  if (sim->timerlist[AorB] != NULL) {
+    printf("Warning: attempt to start a timer that is already started\n");
+    return;
   }
 
   // create future event for when timer goes off
-  evptr = (struct event*) malloc(sizeof(struct event));
-  evptr->evtime   = time + increment;
+  evptr = allocevent();
+  evptr->evtime   = sim->time + increment;
   evptr->evtype   = TIMER_INTERRUPT;
   evptr->eventity = AorB;
+  if (sim->bt != NULL) {
+    bintrace_log(sim->bt, sim->time, TREC_START_TIMER, AorB, 0, 0, evptr->evtime, NULL);
+  }
   insertevent(evptr);
+  sim->timerlist[AorB] = evptr;
 }
 
 void stoptimer(int AorB) {
-  struct event *q, *qold;
-
-  if (TRACE>2) {
-    printf("          STOP TIMER: stopping timer at %f\n",time);
-  }
-
-  for (q=evlist; q != NULL ; q = q->next) {
-    if ( (q->evtype == TIMER_INTERRUPT  && q->eventity==AorB) ) {
-      // remove this event
-      if (q->next == NULL && q->prev == NULL) {
-        // remove first and only event on list
-        evlist=NULL;
-      } else if (q->next == NULL) {
-        // end of list - there is one in front
-        q->prev->next = NULL;
-      } else if (q==evlist) {
-        // front of list - there must be event after
-        q->next->prev = NULL;
-        evlist = q->next;
-      } else {
-        // middle of list
-        q->next->prev = q->prev;
-        q->prev->next = q->next;
-      }
-      free(q);
-      return;
+  if (TRACE_ON(3)) {
+    printf("          STOP TIMER: stopping timer at %f\n",sim->time);
+  }
+
+  if (sim->timerlist[AorB] != NULL) {
+    if (sim->bt != NULL) {
+      bintrace_log(sim->bt, sim->time, TREC_STOP_TIMER, AorB, 0, 0, sim->timerlist[AorB]->evtime, NULL);
     }
+    // mark the event so it is dropped when it reaches the front of the heap
+    sim->timerlist[AorB]->evcancelled = 1;
+    sim->timerlist[AorB] = NULL;
+    return;
   }
   printf("Warning: unable to cancel your timer. It wasn't running.\n");
 }
@@ -436,33 +1292,47 @@ void stoptimer(int AorB) {
 // Pass a packet from layer4 to layer3. This will send it on the network.
 void tolayer3(int AorB, struct pkt packet) {
   struct pkt *mypktptr;
-  struct event *evptr, *q;
-  float lastime, x;
-  int i;
+  struct event *evptr;
+  float arrival, corruptdraw, x;
+  int i, fate;
+  int corrupted = 0;
 
   // Increment the count of how many packets have been sent to layer 3.
-  ntolayer3++;
-
-  // simulate losses:
-  if (jimsrand() < lossprob) {
-    nlost++;
-    if (TRACE > 0) {
-      printf("          TOLAYER3: packet being lost\n");
+  sim->ntolayer3++;
+  metrics_sent(AorB);
+
+  // Every packet takes one number from each stream, whether it is lost or
+  // not, so that the n-th packet always meets the same fate.
+  corruptdraw = simrandom(AorB, STREAM_CORRUPT);
+  x           = simrandom(AorB, STREAM_CORRUPT);
+
+  // simulate losses, and find when the packet arrives if it is not lost
+  fate = channel_send(&sim->chcfg, &sim->channels[AorB], sim->time, &arrival);
+  if (fate != CHANNEL_DELIVERED) {
+    sim->nlost++;
+    if (sim->bt != NULL) {
+      bintrace_log(sim->bt, sim->time, TREC_TOLAYER3, AorB, TREC_LOST, 0, 0.0, &packet);
+    }
+    if (TRACE_ON(1)) {
+      if (fate == CHANNEL_QUEUEFULL) {
+        printf("          TOLAYER3: packet dropped, link queue full\n");
+      } else {
+        printf("          TOLAYER3: packet being lost\n");
+      }
     }
     return;
   }
 
+  // create future event for arrival of packet at the other side
+  evptr = allocevent();
+  evptr->evtype   = FROM_LAYER3;    // packet will pop out from layer3
+  evptr->eventity = (AorB + 1) % 2; // event occurs at other entity
+
   // make a copy of the packet student just gave me since they may decide
   // to do something with the packet after we return back
-  mypktptr = (struct pkt*) malloc(sizeof(struct pkt));
-  mypktptr->seqnum   = packet.seqnum;
-  mypktptr->acknum   = packet.acknum;
-  mypktptr->checksum = packet.checksum;
-  mypktptr->length   = packet.length;
-  for (i=0; i<20; i++) {
-    mypktptr->payload[i] = packet.payload[i];
-  }
-  if (TRACE>2)  {
+  mypktptr = &evptr->pkt;
+  *mypktptr = packet;
+  if (TRACE_ON(3)) {
     printf("          TOLAYER3: seq: %d, ack %d, check: %d ", mypktptr->seqnum,
     mypktptr->acknum,  mypktptr->checksum);
     for (i=0; i<mypktptr->length; i++) {
@@ -471,29 +1341,14 @@ void tolayer3(int AorB, struct pkt packet) {
     printf("\n");
   }
 
-  // create future event for arrival of packet at the other side
-  evptr = (struct event *)malloc(sizeof(struct event));
-  evptr->evtype   = FROM_LAYER3;    // packet will pop out from layer3
-  evptr->eventity = (AorB + 1) % 2; // event occurs at other entity
-  evptr->pktptr   = mypktptr;       // save ptr to my copy of packet
-
-  // Finally, compute the arrival time of packet at the other end.
-  // medium can not reorder, so make sure packet arrives between 1 and 10
-  // time units after the latest arrival time of packets
-  // currently in the medium on their way to the destination
-  lastime = time;
-  for (q=evlist; q!=NULL; q = q->next) {
-    if (q->evtype==FROM_LAYER3 && q->eventity==evptr->eventity) {
-      lastime = q->evtime;
-    }
-  }
-
-  evptr->evtime = lastime + 1 + (9*jimsrand());
+  // Finally, the arrival time of packet at the other end, as the channel
+  // model decided.
+  evptr->evtime = arrival;
 
   // simulate corruption
-  if (jimsrand() < corruptprob)  {
-    ncorrupt++;
-    x = jimsrand();
+  if (corruptdraw < sim->corruptprob)  {
+    sim->ncorrupt++;
+    corrupted = 1;
     if (x < .75) {
       mypktptr->payload[0] = 'Z';   /* corrupt payload */
     } else if (x < .85) {
@@ -504,22 +1359,41 @@ void tolayer3(int AorB, struct pkt packet) {
       mypktptr->length = 656565;
     }
 
-    if (TRACE > 0) {
+    if (TRACE_ON(1)) {
       printf("          TOLAYER3: packet being corrupted\n");
     }
 
-    if (TRACE > 2) {
+    if (TRACE_ON(3)) {
       printf("          TOLAYER3: scheduling arrival on other side\n");
     }
   }
 
+  if (sim->bt != NULL) {
+    bintrace_log(sim->bt, sim->time, TREC_TOLAYER3, AorB, corrupted ? TREC_CORRUPT : 0, 0,
+                 evptr->evtime, &packet);
+  }
+
   insertevent(evptr);
 }
 
 // Called to pass a packet up to layer5 on the receiver side
 void tolayer5_B(struct msg message) {
+  tolayer5(B, message);
+}
+
+// Called to pass a packet up to layer5 on A, which receives in a duplex run
+void tolayer5_A(struct msg message) {
+  tolayer5(A, message);
+}
+
+// Pass a message up to layer5 on `AorB`, and on to its output.
+void tolayer5(int AorB, struct msg message) {
   int i;
-  if (TRACE >= 2) {
+  if (message.length < 0 || message.length > 20) {
+    printf("Warning: dropping message with invalid length %d\n", message.length);
+    return;
+  }
+  if (TRACE_ON(2)) {
     printf("          TOLAYER5: data received: ");
     for (i=0; i<message.length; i++) {
       printf("%c", message.data[i]);
@@ -527,5 +1401,53 @@ void tolayer5_B(struct msg message) {
     printf("\n");
   }
 
-  fwrite(message.data, 1, message.length, rx_file);
+  if (sim->bt != NULL) {
+    bintrace_log_deliver(sim->bt, sim->time, AorB, message.length);
+  }
+  if (AorB == B) {
+    metrics_deliver(sim->time, message.length);
+  } else {
+    metrics_deliver_reverse(message.length);
+  }
+  // The data was verified as the other entity's layer 5 sent it.
+  if (sim->verify[(AorB + 1) % 2] != NULL) {
+    verify_delivered(sim->verify[(AorB + 1) % 2], message.data, message.length);
+  }
+  if (AorB == B && sim->output != NULL) {
+    PROFILED(PROF_OUTPUT, sim->output(sim->cbarg, message.data, message.length));
+    return;
+  }
+  if (sim->rx_file[AorB] == NULL) {
+    return;
+  }
+  if (sim->rx_block[AorB] == NULL) {
+    sim->rx_block[AorB] = (char*) malloc(RX_BLOCK_SIZE);
+    if (sim->rx_block[AorB] == NULL) {
+      printf("INTERNAL PANIC: out of memory for the output\n");
+      exit(-1);
+    }
+  }
+  if (sim->rx_len[AorB] + message.length > RX_BLOCK_SIZE) {
+    flushrx(AorB);
+  }
+  memcpy(sim->rx_block[AorB] + sim->rx_len[AorB], message.data, message.length);
+  sim->rx_len[AorB] += message.length;
+  if (sim->rx_len[AorB] >= sim->rx_flush) {
+    flushrx(AorB);
+  }
+}
+
+// Write the data buffered for layer5 on `AorB` to its rx_file. Data for an
+// entity without an output file is never buffered.
+void flushrx(int AorB) {
+  if (sim->rx_len[AorB] > 0) {
+    PROFILED(PROF_OUTPUT, fwrite(sim->rx_block[AorB], 1, sim->rx_len[AorB], sim->rx_file[AorB]));
+    sim->rx_len[AorB] = 0;
+  }
+}
+
+// Write all buffered received data out.
+void flushoutput() {
+  flushrx(A);
+  flushrx(B);
 }
@@ -64,6 +64,10 @@ void stoptimer_A ();
 // send the packet to entity "B".
 void tolayer3_A (struct pkt packet);
 
+// Allows entity "A" to pass a message from layer 4 to layer 5, in a duplex run
+// where "B" sends data to "A" as well.
+void tolayer5_A (struct msg message);
+
 
 /**** B ENTITY ****/
 
@@ -85,3 +89,9 @@ void tolayer3_B (struct pkt packet);
 // Allows entity "B" to pass a message from layer 4 to layer 5. This represents
 // properly received data passed over the network.
 void tolayer5_B (struct msg message);
+
+
+/**** BOTH ENTITIES ****/
+
+// The current simulation time.
+float simtime();
@@ -0,0 +1,39 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* TRACE OUTPUT                                                               */
+/*                                                                            */
+/******************************************************************************/
+
+// Debug output from the simulator and the entities goes through these macros.
+// A statement at `level` prints only when the run-time TRACE level (the
+// <debug> command line argument) is at least `level`:
+//
+//   1 : one line per protocol step (entity messages, lost/corrupt packets)
+//   2 : every simulator event and every message delivered to layer 5
+//   3 : event list, timer and payload details
+//
+// Statements above TRACE_MAX are removed at compile time, so building with
+// -DTRACE_MAX=0 gives a simulator that does no formatting work per packet.
+
+#include <stdio.h>
+
+#ifndef TRACE_MAX
+#define TRACE_MAX 3
+#endif
+
+// Run-time trace level of the simulation the calling thread is running,
+// defined in simulator.c.
+extern _Thread_local int TRACE;
+
+// True if output at `level` is both compiled in and enabled.
+#define TRACE_ON(level) ((level) <= TRACE_MAX && TRACE >= (level))
+
+// printf() that only runs when output at `level` is enabled.
+#define TRACEF(level, ...)       \
+  do {                           \
+    if (TRACE_ON(level)) {       \
+      printf(__VA_ARGS__);       \
+    }                            \
+  } while (0)
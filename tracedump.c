@@ -0,0 +1,120 @@
+/******************************************************************************/
+/*                                                                            */
+/* BINARY TRACE DECODER                                                       */
+/*                                                                            */
+/******************************************************************************/
+
+// Prints a binary trace written by the simulator's `-t <file>` option as text,
+// or as CSV with `-c`. Build it on its own:
+//
+//     $ gcc tracedump.c -o tracedump
+//     $ ./tracedump [-c] trace.bin
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bintrace.h"
+
+const char *kindnames[] = {
+  "event", "insert", "tolayer3", "starttimer", "stoptimer", "tolayer5"
+};
+
+const char *evtypenames[] = {
+  "timerinterrupt", "fromlayer5", "fromlayer3"
+};
+
+const char *kindname(int kind) {
+  if (kind < 0 || kind > TREC_TOLAYER5) {
+    return "unknown";
+  }
+  return kindnames[kind];
+}
+
+const char *evtypename(const struct tracerec *rec) {
+  if (rec->kind != TREC_EVENT && rec->kind != TREC_INSERT) {
+    return "";
+  }
+  if (rec->evtype > 2) {
+    return "unknown";
+  }
+  return evtypenames[rec->evtype];
+}
+
+void printtext(const struct tracerec *rec) {
+  printf("%f  %-10s  entity: %c", rec->time, kindname(rec->kind),
+         rec->entity == 0 ? 'A' : 'B');
+  if (rec->kind == TREC_EVENT || rec->kind == TREC_INSERT) {
+    printf("  %s", evtypename(rec));
+  }
+  if (rec->kind == TREC_INSERT || rec->kind == TREC_START_TIMER) {
+    printf("  at: %f", rec->evtime);
+  }
+  if (rec->flags & TREC_HAS_PKT) {
+    printf("  seq: %d, ack: %d, check: %d, len: %d", rec->seqnum, rec->acknum,
+           rec->checksum, rec->length);
+  }
+  if (rec->kind == TREC_TOLAYER5) {
+    printf("  len: %d", rec->length);
+  }
+  if (rec->flags & TREC_LOST) {
+    printf("  LOST");
+  }
+  if (rec->flags & TREC_CORRUPT) {
+    printf("  CORRUPT");
+  }
+  printf("\n");
+}
+
+void printcsv(const struct tracerec *rec) {
+  printf("%f,%s,%c,%s,%f,%d,%d,%d,%d,%d,%d\n", rec->time, kindname(rec->kind),
+         rec->entity == 0 ? 'A' : 'B', evtypename(rec), rec->evtime,
+         rec->seqnum, rec->acknum, rec->checksum, rec->length,
+         (rec->flags & TREC_LOST) != 0, (rec->flags & TREC_CORRUPT) != 0);
+}
+
+int main(int argc, char* argv[]) {
+  struct traceheader header;
+  struct tracerec rec;
+  FILE* file;
+  int csv = 0;
+  const char *path;
+
+  if (argc == 3 && strcmp(argv[1], "-c") == 0) {
+    csv = 1;
+    path = argv[2];
+  } else if (argc == 2) {
+    path = argv[1];
+  } else {
+    printf("usage: %s [-c] <trace file>\n", argv[0]);
+    exit(-1);
+  }
+
+  file = fopen(path, "rb");
+  if (file == NULL) {
+    printf("Could not open trace file.\n");
+    exit(-1);
+  }
+
+  if (fread(&header, sizeof(header), 1, file) != 1 ||
+      memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+      header.version != TRACE_VERSION ||
+      header.recsize != sizeof(struct tracerec)) {
+    printf("%s is not a trace file this decoder understands.\n", path);
+    exit(-1);
+  }
+
+  if (csv) {
+    printf("time,kind,entity,evtype,evtime,seqnum,acknum,checksum,length,lost,corrupt\n");
+  }
+  while (fread(&rec, sizeof(rec), 1, file) == 1) {
+    if (csv) {
+      printcsv(&rec);
+    } else {
+      printtext(&rec);
+    }
+  }
+
+  fclose(file);
+  return 0;
+}
@@ -0,0 +1,210 @@
+/******************************************************************************/
+/*                                                                            */
+/* OUTPUT VERIFICATION                                                        */
+/*                                                                            */
+/******************************************************************************/
+
+// The verifier described in verify.h. Delivered bytes are compared with memcmp
+// a contiguous run at a time against a block of the input file, which is read
+// afresh as the delivered offset moves past it.
+
+// Offsets into the input file are 64 bits even where long is not.
+#define _FILE_OFFSET_BITS 64
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "verify.h"
+
+#define VERIFY_BLOCK_SIZE (1 << 16)
+
+#define FNV_OFFSET 0xcbf29ce484222325ULL
+#define FNV_PRIME  0x100000001b3ULL
+
+struct verify {
+  uint64_t senthash;       // FNV-1a of every byte sent so far.
+  uint64_t deliveredhash;  // FNV-1a of every byte delivered so far.
+  long long sent;          // Bytes sent so far.
+  long long delivered;     // Bytes delivered so far.
+  long long divergence;    // First differing offset, or -1.
+
+  // The input file, read again to compare against, or NULL when there is
+  // none and only the hashes are compared. `block` holds `blocklen` bytes of
+  // it from offset `blockstart`, and the file is positioned at `filepos`.
+  FILE  *input;
+  char  *block;
+  long long blockstart;
+  size_t blocklen;
+  long long filepos;
+};
+
+static uint64_t fnv1a(uint64_t h, const char *data, int length) {
+  int i;
+
+  for (i = 0; i < length; i++) {
+    h ^= (unsigned char) data[i];
+    h *= FNV_PRIME;
+  }
+  return h;
+}
+
+struct verify *verify_create(const char *path) {
+  struct verify *v;
+
+  v = (struct verify*) calloc(1, sizeof(struct verify));
+  if (v == NULL) {
+    return NULL;
+  }
+  if (path != NULL) {
+    v->block = (char*) malloc(VERIFY_BLOCK_SIZE);
+    v->input = fopen(path, "rb");
+    if (v->block == NULL || v->input == NULL) {
+      verify_destroy(v);
+      return NULL;
+    }
+    // The blocks are all the buffering needed.
+    setvbuf(v->input, NULL, _IONBF, 0);
+  }
+  v->senthash      = FNV_OFFSET;
+  v->deliveredhash = FNV_OFFSET;
+  v->divergence    = -1;
+  return v;
+}
+
+// Make the block hold the input file from `offset` on, if it does not
+// already. Returns 0 if the file ends there.
+static int blockat(struct verify *v, long long offset) {
+  if (offset >= v->blockstart && offset < v->blockstart + (long long) v->blocklen) {
+    return 1;
+  }
+  if (offset != v->filepos) {
+    if (fseeko(v->input, (off_t) offset, SEEK_SET) != 0) {
+      return 0;
+    }
+  }
+  v->blockstart = offset;
+  v->blocklen   = fread(v->block, 1, VERIFY_BLOCK_SIZE, v->input);
+  v->filepos    = offset + (long long) v->blocklen;
+  return v->blocklen > 0;
+}
+
+void verify_sent(struct verify *v, const char *data, int length) {
+  if (length <= 0) {
+    return;
+  }
+  v->senthash = fnv1a(v->senthash, data, length);
+  v->sent += length;
+}
+
+void verify_delivered(struct verify *v, const char *data, int length) {
+  long long offset;
+  size_t n, done = 0, i;
+  const char *expect;
+
+  if (length <= 0) {
+    return;
+  }
+  v->deliveredhash = fnv1a(v->deliveredhash, data, length);
+  while (v->divergence < 0 && done < (size_t) length) {
+    offset = v->delivered + (long long) done;
+    if (offset >= v->sent) {
+      // B delivered more than A was given.
+      v->divergence = offset;
+      break;
+    }
+    if (v->input == NULL) {
+      // Nothing to compare the bytes with.
+      break;
+    }
+    if (!blockat(v, offset)) {
+      // The input file ends before what A was given.
+      v->divergence = offset;
+      break;
+    }
+    // Compare against the contiguous run of the block at this offset.
+    expect = v->block + (offset - v->blockstart);
+    n = v->blocklen - (size_t) (offset - v->blockstart);
+    if (n > (size_t) length - done) {
+      n = (size_t) length - done;
+    }
+    if (memcmp(expect, data + done, n) != 0) {
+      for (i = 0; expect[i] == data[done + i]; i++) {
+      }
+      v->divergence = offset + (long long) i;
+      break;
+    }
+    done += n;
+  }
+  v->delivered += length;
+}
+
+long long verify_divergence(struct verify *v, int finished) {
+  if (v->divergence >= 0 || !finished) {
+    return v->divergence;
+  }
+  if (v->input == NULL && v->deliveredhash != v->senthash) {
+    // The streams differ somewhere, but without the input there is no
+    // telling where.
+    return 0;
+  }
+  if (v->delivered != v->sent) {
+    return v->delivered;
+  }
+  return -1;
+}
+
+void verify_report(struct verify *v, FILE *out, int finished) {
+  long long offset = verify_divergence(v, finished);
+
+  fprintf(out, " verify: sent      %lld bytes, hash %016llx\n", v->sent,
+          (unsigned long long) v->senthash);
+  fprintf(out, " verify: delivered %lld bytes, hash %016llx\n", v->delivered,
+          (unsigned long long) v->deliveredhash);
+  if (offset < 0) {
+    fprintf(out, " verify: OK\n");
+  } else if (v->divergence < 0 && v->input == NULL) {
+    fprintf(out, " verify: FAILED, hashes differ (no input file to find where)\n");
+  } else if (offset == v->delivered && v->divergence < 0) {
+    fprintf(out, " verify: FAILED, output ends at byte %lld of %lld\n", offset, v->sent);
+  } else {
+    fprintf(out, " verify: FAILED, first difference at byte offset %lld\n", offset);
+  }
+}
+
+// Only the counts and hashes are written. A verifier loaded from them reads
+// the input file again from the delivered offset.
+int verify_save(struct verify *v, FILE *file) {
+  if (fwrite(&v->senthash, sizeof(v->senthash), 1, file) != 1 ||
+      fwrite(&v->deliveredhash, sizeof(v->deliveredhash), 1, file) != 1 ||
+      fwrite(&v->sent, sizeof(v->sent), 1, file) != 1 ||
+      fwrite(&v->delivered, sizeof(v->delivered), 1, file) != 1 ||
+      fwrite(&v->divergence, sizeof(v->divergence), 1, file) != 1) {
+    return -1;
+  }
+  return 0;
+}
+
+int verify_load(struct verify *v, FILE *file) {
+  if (fread(&v->senthash, sizeof(v->senthash), 1, file) != 1 ||
+      fread(&v->deliveredhash, sizeof(v->deliveredhash), 1, file) != 1 ||
+      fread(&v->sent, sizeof(v->sent), 1, file) != 1 ||
+      fread(&v->delivered, sizeof(v->delivered), 1, file) != 1 ||
+      fread(&v->divergence, sizeof(v->divergence), 1, file) != 1) {
+    return -1;
+  }
+  v->blockstart = 0;
+  v->blocklen   = 0;
+  return 0;
+}
+
+void verify_destroy(struct verify *v) {
+  if (v == NULL) {
+    return;
+  }
+  if (v->input != NULL) {
+    fclose(v->input);
+  }
+  free(v->block);
+  free(v);
+}
@@ -0,0 +1,57 @@
+#pragma once
+
+/******************************************************************************/
+/*                                                                            */
+/* OUTPUT VERIFICATION                                                        */
+/*                                                                            */
+/******************************************************************************/
+
+// Checks that the bytes B hands to layer 5 are exactly the bytes A got from
+// layer 5, while the run goes on, so that a run needs no comparison of
+// output.dat with the input afterwards.
+//
+// Both streams are hashed as they pass (64-bit FNV-1a). When A's input is a
+// file, the verifier opens it again and compares each delivered byte with the
+// one at the same offset in the file, so the first difference is found as
+// soon as it is delivered. It reads the file in fixed blocks and keeps
+// nothing else of either stream, so its memory does not depend on the length
+// of the run or on how much A has queued. Without a file (input from a
+// callback) only the lengths and hashes are compared, at the end of the run,
+// and a difference can not be placed.
+
+#include <stdio.h>
+
+struct verify;
+
+// Allocate a verifier with both streams empty, comparing against the file at
+// `path`, or only by hash when `path` is NULL. Returns NULL if out of memory
+// or the file can not be opened.
+struct verify *verify_create(const char *path);
+
+// Layer 5 on A produced `length` bytes at `data`.
+void verify_sent(struct verify *v, const char *data, int length);
+
+// B passed `length` bytes at `data` to layer 5.
+void verify_delivered(struct verify *v, const char *data, int length);
+
+// Offset of the first byte where the delivered stream differs from the sent
+// one, or -1 if they agree so far. Once the run has ended, a delivered stream
+// that stops short of the sent one differs at its end, and one checked only by
+// hash that does not match differs at an unknown offset, given as 0.
+long long verify_divergence(struct verify *v, int finished);
+
+// Print the outcome to `out`: the length and hash of both streams, and where
+// they first differ if they do. `finished` is set once the run has ended.
+void verify_report(struct verify *v, FILE *out, int finished);
+
+// Write the state of `v` to `file`, for a checkpoint of the simulation.
+// Returns 0, or -1 if the write failed.
+int verify_save(struct verify *v, FILE *file);
+
+// Replace the state of `v` with one written by verify_save(). It must compare
+// against the same file as the verifier saved. Returns 0, or -1 if the file is
+// short.
+int verify_load(struct verify *v, FILE *file);
+
+// Free `v`. Does nothing when `v` is NULL.
+void verify_destroy(struct verify *v);